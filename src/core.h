@@ -3,13 +3,13 @@
 #include <LittleFS.h>
 #include <RTClib.h>
 #include <sunset.h>
-#include <NTPClient.h>
 #include <WiFiUdp.h>
 #include <ESP8266WebServer.h>
 #include <ESP8266HTTPClient.h>
 #include <ESP8266mDNS.h>
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
+#include <coredecls.h>
 #include "main.h"
 
 #ifdef physical_clock
@@ -22,28 +22,137 @@ ESP8266WebServer server(80);
 WiFiClient wifiClient;
 HTTPClient httpClient;
 WiFiUDP wifiUdp;
-NTPClient ntpClient(wifiUdp);
 SunSet sun;
 
+class ChunkedPrint : public Print { // Gathers small prints into a stack buffer, then sends it as a chunk of the HTTP reply.
+  public:
+    ChunkedPrint() : length(0) {}
+
+    size_t write(uint8_t c) override {
+      buffer[length++] = c;
+      if (length == sizeof(buffer)) {
+        flush();
+      }
+      return 1;
+    }
+
+    void flush() override {
+      if (length == 0) {
+        return;
+      }
+      server.sendContent((const char*)buffer, length);
+      length = 0;
+    }
+
+  private:
+    uint8_t buffer[128];
+    size_t length;
+};
+
+const int sun_days = 366; // Days in /sun.bin, one for each day of a leap year.
+const uint16_t days_before_month[] = {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335}; // In a leap year, so 29 February has its own day.
+String sun_table_location = "";
+
+const int16_t sine_table[91] = { // sin(0..90 degrees) * 16384
+  0, 286, 572, 857, 1143, 1428, 1713, 1997, 2280, 2563, 2845, 3126, 3406, 3686, 3964, 4240, 4516, 4790, 5063, 5334,
+  5604, 5872, 6138, 6402, 6664, 6924, 7182, 7438, 7692, 7943, 8192, 8438, 8682, 8923, 9162, 9397, 9630, 9860, 10087, 10311,
+  10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365, 12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+  14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296, 15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+  16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382, 16384
+};
+String sun_position_location = "";
+int sun_latitude = 0; // Tenths of a degree.
+int sun_longitude = 0;
+int sun_azimuth = -1; // Tenths of a degree clockwise from the north, -1 when unknown.
+int sun_elevation = 0; // Tenths of a degree above the horizon.
+
 const int core_version = 25;
 bool offline = true;
 bool keep_log = false;
 int last_accessed_log = 0;
 
+const int log_segments = 4;
+const uint32_t log_segment_size = 16384; // Bytes per segment, so the log never takes more than 64 KB.
+const unsigned int log_block = 512; // Bytes gathered in RAM before they are written to the log.
+const uint32_t log_window = 10000; // Milliseconds a line may wait in RAM.
+struct LogIndex {
+  uint8_t head; // Segment being written.
+  uint32_t first[log_segments]; // Number of the first record in each segment.
+};
+LogIndex log_index;
+uint32_t log_records = 0;
+String log_buffer = "";
+uint32_t log_buffer_millis = 0;
+
 const char days_of_the_week[7][2] = {"s", "o", "u", "e", "h", "r", "a"};
 char host_name[30] = {0};
 
 struct Device {
   String ip;
   String mac;
+  uint8_t failures;
+  String pending; // Payload waiting to be sent, newer keys replace older ones.
+  bool pending_log;
+  uint8_t attempts;
+  uint32_t retry_millis;
+  uint32_t latency_ms;
+  uint32_t sequence; // Last announcement received from the peer.
+  uint32_t announced_millis; // 0 until the peer is heard over multicast.
+  int8_t position[3]; // Last announced position of its wings in percent, -1 for a wing it doesn't have.
 };
 
-Device *devices_array;
+const int max_devices = 20;
+const uint32_t devices_ttl = 3600000; // Milliseconds the peer table is trusted before it is queried again.
+Device devices_array[max_devices];
 int devices_count = 0;
+uint32_t devices_discovery_millis = 0;
+bool devices_stale = true;
+const uint16_t broadcast_timeout = 400; // Milliseconds a single peer may hold up the loop.
+const uint8_t broadcast_attempts = 4;
+
+const uint8_t announce_light = 1;
+const uint8_t announce_twilight = 2;
+const uint8_t announce_position = 4;
+const uint8_t announce_time = 8;
+const uint16_t multicast_port = 5610;
+IPAddress multicast_address(239, 255, 73, 68);
+WiFiUDP multicastUdp;
+bool multicast = false;
+uint32_t announcement_sequence = 0;
+const uint32_t announced_ttl = 7200000; // Milliseconds after the last announcement that a peer still gets no /set; time is announced hourly.
+
+struct __attribute__((packed)) Announcement {
+  char magic[2]; // "iD"
+  uint8_t fields; // Announce bits of the values below that are set.
+  uint8_t twilight;
+  uint32_t sequence;
+  int16_t light;
+  int8_t position[3];
+  uint32_t time;
+};
 
 String ssid = "";
 String password = "";
 bool auto_reconnect = false;
+const uint8_t wifi_off = 0;
+const uint8_t wifi_connecting = 1;
+const uint8_t wifi_wps = 2;
+const uint8_t wifi_connected = 3; // Services are started on the next pass.
+const uint8_t wifi_time = 4;
+const uint8_t wifi_peers = 5; // One peer is asked for its data per pass.
+const uint8_t wifi_ready = 6;
+const uint32_t wifi_timeout = 5000;
+uint8_t wifi_state = wifi_off;
+const char* const ntp_server = "pool.ntp.org";
+const uint16_t ntp_port = 123;
+const uint16_t ntp_local_port = 1337;
+const uint32_t ntp_timeout = 1000;
+IPAddress ntp_address;
+uint32_t ntp_millis = 0; // When the pending time request was sent, 0 when none is pending.
+uint32_t wifi_state_millis = 0;
+int wifi_peer = 0;
+int wifi_peers_count = 0;
+uint32_t first_step_millis = 0; // Time from the boot to the first step.
 
 uint32_t start_u_time = 0;
 uint32_t loop_u_time = 0;
@@ -51,60 +160,139 @@ int uprisings = 1;
 int offset = 0;
 bool dst = false;
 
+const uint8_t smart_action_none = 0;
+const uint8_t smart_action_value = 1;
+const uint8_t smart_action_wings = 2;
+const uint8_t smart_action_remote = 3;
+
+const uint8_t smart_condition_none = 0;
+const uint8_t smart_condition_equal = 1;
+const uint8_t smart_condition_below = 2;
+const uint8_t smart_condition_above = 3;
+
+const uint8_t twilight_sunset = 1;
+const uint8_t twilight_sunrise = 2;
+const uint8_t twilight_dusk = 4;
+const uint8_t twilight_dawn = 8;
+
+const uint8_t every_day = 127;
+
+const int smart_input_level = 0; // Time ranges, evaluated on every pass.
+const int smart_input_light = 1;
+const int smart_input_switch = 2;
+const int smart_input_position = 3;
+const int smart_input_temperature = 4;
+const int smart_input_delay = 5; // Offset countdowns, evaluated while counting.
+const int smart_input_sun = 6; // Sun position, evaluated once a minute.
+const int smart_inputs = 7;
+
+struct SmartAction {
+  uint8_t type;
+  int8_t value[3];
+};
+
+struct SmartState { // Runtime state of a rule, saved in /smart.bin apart from the definition.
+  uint32_t id; // crc32 of the definition string.
+  uint32_t lead_u_time;
+  int16_t local_dusk_time;
+  int16_t local_dawn_time;
+  int16_t dusk_day;
+  int16_t dawn_day;
+  #ifdef light_switch
+    int32_t switch_offset_countdown;
+  #endif
+  #ifdef blinds
+    int32_t blinds_offset_countdown;
+  #endif
+  #ifdef thermostat
+    int32_t thermostat_offset_countdown;
+  #endif
+  #ifdef chain
+    int32_t chain_offset_countdown;
+  #endif
+  bool has_lowering_at_sunset_offset;
+};
+
 struct Smart {
   String smart_string;
   bool enabled;
-  String days;
+  uint8_t days; // Bit per day of the week, Sunday first.
   #if defined(light_switch) || defined(blinds)
-    String what;
+    uint8_t what; // Bit per wing, 0 when not specified.
   #endif
   bool any_trigger_required;
-  String action;
+  uint8_t inputs; // Bit per smart_input_ the rule subscribes to; clock and sun triggers come from the timeline.
+  #ifdef blinds
+    SmartAction action;
+  #else
+    String action;
+  #endif
   int at_time;
   int start_time;
   int end_time;
   bool at_sunset;
   int sunset_offset;
-  bool has_lowering_at_sunset_offset;
   bool at_sunrise;
   int sunrise_offset;
   int at_dusk;
-  int local_dusk_time;
   int dusk_offset;
-  int dusk_day;
   int at_dawn;
-  int local_dawn_time;
   int dawn_offset;
-  int dawn_day;
   #ifdef light_switch
   String at_switch;
   int switch_offset;
-  int switch_offset_countdown;
   #endif
   #ifdef blinds
-    String at_blinds;
+    int8_t at_blinds[3]; // -1 when there is no position trigger.
     int blinds_offset;
-    int blinds_offset_countdown;
+    int16_t sun_facade; // Degrees clockwise from the north the window faces, -1 when there is no sun trigger.
+    int16_t sun_range;
+    int16_t sun_height;
   #endif
   #ifdef thermostat
     String at_thermostat;
     int thermostat_offset;
-    int thermostat_offset_countdown;
   #endif
   #ifdef chain
     String at_chain;
     int chain_offset;
-    int chain_offset_countdown;
   #endif
-  String must_be_; // This is a fulfillment condition, not a trigger.
-  String twilight_must_be_;
-  uint32_t lead_u_time;
+  #ifdef blinds
+    uint8_t must_be_[3]; // This is a fulfillment condition, not a trigger.
+    int8_t must_be_value[3];
+  #else
+    String must_be_; // This is a fulfillment condition, not a trigger.
+  #endif
+  uint8_t twilight_must_be_;
+  SmartState state;
 };
 
 Smart *smart_array;
 int smart_count = 0;
+int smart_capacity = 0;
+int smart_log_count = 0; // Rule operations in /smart.log since the settings were last written.
+const int smart_log_limit = 32;
 bool smart_lock = false;
 
+struct SmartEvent {
+  int time;
+  int smart;
+};
+const int smart_events = 6; // At most per rule: time, sunset, sunrise, dusk and dawn offsets, sunset for the dawn.
+
+SmartEvent *smart_timeline;
+int smart_timeline_count = 0;
+int smart_timeline_capacity = 0;
+int smart_timeline_next = 0;
+int *smart_subscribers; // Rules grouped by input, from smart_subscribers_first[input].
+int smart_subscribers_first[smart_inputs + 1];
+int *smart_candidates;
+bool smart_timeline_update = true;
+int timeline_day = -1;
+int timeline_time = -1;
+int timeline_sunset = -1;
+int timeline_sunrise = -1;
+
 const String default_location = "52.2337172x21.0714322";
 String geo_location = default_location;
 int last_sun_check = -1;
@@ -118,6 +306,71 @@ int light_sensor = -1;
 bool sensor_twilight = false;
 bool calendar_twilight = false;
 
+struct Profile {
+  uint32_t count;
+  uint64_t total_us;
+  uint32_t max_us;
+};
+
+const int profile_smart = 0;
+const int profile_rotation = 1;
+const int profile_settings = 2;
+const int profile_set = 3;
+const int profiles = 4;
+const char profile_names[profiles][9] = {"smart", "rotation", "settings", "set"};
+Profile profile_array[profiles];
+uint32_t loop_counter = 0;
+uint32_t loops_per_second = 0;
+
+const uint32_t settings_window = 5000; // Milliseconds to gather the settings changes into a single write.
+bool settings_dirty = false;
+bool settings_log = false;
+uint32_t settings_dirty_millis = 0;
+uint32_t settings_generation = 0;
+uint32_t settings_requests = 0;
+
+struct Setting {
+  const char* key;
+  uint8_t type;
+  void* target;
+  int32_t fallback; // Value that is not written to the settings file.
+  uint8_t flags;
+  void (*hook)(); // Called after a change received by /set.
+};
+
+const uint8_t setting_int = 0;
+const uint8_t setting_uint = 1;
+const uint8_t setting_bool = 2;
+const uint8_t setting_string = 3;
+const uint8_t setting_triple = 4; // int[3], an array in the file, "1;2;3" or a single value in /set.
+
+const uint8_t setting_saved = 1;
+const uint8_t setting_received = 2;
+const uint8_t setting_details = 4;
+const uint8_t setting_clearable = 8; // A string written even when empty, as it has a default that isn't.
+
+uint32_t set_memory = 0; // The largest /set document in bytes.
+
+uint32_t state_generation = 0; // Bumped by every change shown in the handshake.
+const int max_commands = 8; // Payloads of /set and /basicdata waiting for the loop.
+String command_queue[max_commands];
+bool command_per_peer[max_commands]; // Sent by another iDom device.
+int command_head = 0;
+int command_count = 0;
+uint32_t commands_dropped = 0;
+
+struct Snapshot {
+  String text;
+  uint32_t generation;
+  uint32_t refreshed_millis;
+};
+const uint32_t snapshot_age = 1000; // The longest a GET reply may lag behind the moving blinds.
+Snapshot state_snapshot;
+Snapshot basic_snapshot;
+
+String hello_cache[2]; // Static part of the handshake, with ";" and "," separators.
+uint32_t hello_generation[2] = {0, 0};
+
 bool strContains(String text, String value);
 bool strContains(String text, int value);
 bool strContains(int text, int value);
@@ -132,24 +385,102 @@ String get1(String text, int index, char separator);
 String oldSmart2NewSmart(const String& smart_string);
 String getSmartString(bool raw);
 void setSmart(const String& smart_string);
-DynamicJsonDocument getSmartJson(bool raw);
+int findSmart(uint32_t id);
+int checkSmartOperation(char operation, uint32_t id, const String& single_smart_string);
+uint32_t applySmartOperation(char operation, uint32_t id, const String& single_smart_string);
+void logSmartOperation(char operation, uint32_t id, const String& single_smart_string);
+void replaySmartLog();
+void clearSmartLog();
+void changeSmart(char operation);
+void addSmart();
+void replaceSmart();
+void removeSmart();
+void enableSmart();
+void disableSmart();
+void compileSmart(Smart& smart, String single_smart_string);
+String getSmartParameter(const String& text, String key);
+String getSmartAction(const String& smart_string);
+String getSmartDays(uint8_t days);
+#if defined(light_switch) || defined(blinds)
+  String getSmartWhat(uint8_t what);
+#endif
+#ifdef blinds
+  String getSmartValue(SmartAction action);
+  SmartAction getSmartAction(SmartAction action, int fallback);
+#endif
+void printJsonKey(Print& output, bool& first, const char* key);
+void printJsonText(Print& output, const String& text);
+void printJsonTime(Print& output, int time);
+void printSmartJson(Print& output, bool raw);
+void saveSmartState();
+void readSmartState();
+void migrateSmartState();
+void buildSmartTimeline(int day);
+void addSmartEvent(int time, int smart);
+int getSmartCandidates(int current_time, int trigger);
+int addSmartCandidate(int count, int smart);
+bool isSmartCounting(int smart);
+bool hasSmartCondition(int smart);
 void smartAction(int trigger, bool twilight_change);
-void connectingToWifi(bool use_wps);
+void setWiFiState(uint8_t state);
+void connectingToWifi();
 void initiatingWPS();
+void requestTime();
+bool receiveTime();
+void readTheLog();
+void flushTheLog(bool force);
+void saveTheLogIndex();
+void removeTheLog();
+String getLogSegment(int segment);
 void activationTheLog();
 void deactivationTheLog();
 void requestForLogs();
 void clearTheLog();
+void setLocation();
 void getSunriseSunset(DateTime now);
+bool buildSunTable();
+bool getSunTable(int month, int day, int& sunrise, int& sunset);
+int sinus(int angle);
+int cosinus(int angle);
+int arcsinus(int value);
+void getSunPosition(uint32_t u_time);
 int findMDNSDevices();
+int getDevices();
+int addDevice(String ip);
+void setDeviceId(String ip, String mac);
+void removeDevice(int index);
+void hasDeviceFailed(int index, bool failed);
+void readDevices();
+void saveDevices();
+void onMDNSAnswer(MDNSResponder::MDNSServiceInfo service_info, MDNSResponder::AnswerType answer_type, bool set_content);
 void receivedOfflineData();
+bool queueCommand(const String& payload);
+bool queueCommand(const String& payload, bool per_peer);
+bool isPeer(const String& ip);
+void runCommand();
+bool isSnapshotStale(Snapshot& snapshot);
 void putOfflineData(String url, String data);
 void putMultiOfflineData(String data);
 void putMultiOfflineData(String data, bool log);
-void getOfflineData();
+void sendOfflineData();
+void beginMulticast();
+void announce(uint8_t fields);
+void receiveAnnouncements();
+bool isAnnouncing(int index);
+void getOfflineData(int index);
 void setupOTA();
 void getSmartDetail();
 void getRawSmartDetail();
+void profile(int index, uint32_t start_us);
+void getPerformance();
+void clearPerformance();
+void flushSettings(bool force);
+uint32_t getSettingsGeneration(bool backup);
+bool getSettingFlag(JsonVariant value);
+void getSettingTriple(JsonVariant value, int triple[3]);
+void readSetting(const Setting& setting, JsonVariant value);
+void writeSetting(const Setting& setting, JsonDocument& json_object);
+bool receiveSetting(const Setting& setting, JsonVariant value);
 
 
 bool strContains(String text, String value) {
@@ -198,9 +529,12 @@ bool RTCisrunning() {
 }
 
 bool hasTimeChanged() {
+  loop_counter++;
   int current_u_time = RTCisrunning() ? rtc.now().unixtime() : millis() / 1000;
   if (abs(current_u_time - (int)loop_u_time) >= 1) {
     loop_u_time = current_u_time;
+    loops_per_second = loop_counter;
+    loop_counter = 0;
     return true;
   }
   return false;
@@ -231,10 +565,12 @@ void note(String text) {
   Serial.print("\n" + log_text);
 
   if (keep_log) {
-    File file = LittleFS.open("/log.txt", "a");
-    if (file) {
-      file.println(log_text);
-      file.close();
+    if (log_buffer.length() == 0) {
+      log_buffer_millis = millis();
+    }
+    log_buffer += log_text + "\n";
+    if (log_buffer.length() >= log_block) {
+      flushTheLog(true);
     }
   }
 }
@@ -422,291 +758,456 @@ String getSmartString(bool raw) {
   return result;
 }
 
-DynamicJsonDocument getSmartJson(bool raw) {
-  DynamicJsonDocument json_object(smart_count * 400);
+void printJsonKey(Print& output, bool& first, const char* key) {
+  output.print(first ? "\"" : ",\"");
+  output.print(key);
+  output.print("\":");
+  first = false;
+}
+
+void printJsonText(Print& output, const String& text) {
+  output.print("\"");
+  for (unsigned int i = 0; i < text.length(); i++) {
+    if (text[i] == '"' || text[i] == '\\') {
+      output.print("\\");
+    }
+    output.write((uint8_t)text[i]);
+  }
+  output.print("\"");
+}
+
+void printJsonTime(Print& output, int time) {
+  output.print("\"");
+  output.print(time / 60);
+  output.print(time % 60 < 10 ? ":0" : ":");
+  output.print(time % 60);
+  output.print("\"");
+}
+
+void printSmartJson(Print& output, bool raw) {
   int i = -1;
   bool local_result;
+  bool first;
   int count = -1;
 
+  output.print("{");
   while (++i < smart_count) {
-    local_result = (smart_array[i].at_sunset && smart_array[i].has_lowering_at_sunset_offset) || smart_array[i].lead_u_time > 0
-    || (smart_array[i].at_dusk > -1 && (smart_array[i].local_dusk_time > 0 || smart_array[i].dusk_day > -1))
-    || (smart_array[i].at_dawn > -1 && (smart_array[i].local_dawn_time > 0 || smart_array[i].dawn_day > -1));
+    local_result = (smart_array[i].at_sunset && smart_array[i].state.has_lowering_at_sunset_offset) || smart_array[i].state.lead_u_time > 0
+    || (smart_array[i].at_dusk > -1 && (smart_array[i].state.local_dusk_time > 0 || smart_array[i].state.dusk_day > -1))
+    || (smart_array[i].at_dawn > -1 && (smart_array[i].state.local_dawn_time > 0 || smart_array[i].state.dawn_day > -1));
     #ifdef light_switch
-      local_result |= smart_array[i].at_switch != "?" && smart_array[i].switch_offset_countdown > 0;
+      local_result |= smart_array[i].at_switch != "?" && smart_array[i].state.switch_offset_countdown > 0;
     #endif
     #ifdef blinds
-    local_result |= smart_array[i].at_blinds != "?" && smart_array[i].blinds_offset_countdown > 0;
+      local_result |= smart_array[i].at_blinds[0] > -1 && smart_array[i].state.blinds_offset_countdown > 0;
     #endif
     #ifdef thermostat
-      local_result |= smart_array[i].at_thermostat != "?" && smart_array[i].thermostat_offset_countdown > 0;
+      local_result |= smart_array[i].at_thermostat != "?" && smart_array[i].state.thermostat_offset_countdown > 0;
     #endif
     #ifdef chain
-      local_result |= smart_array[i].at_chain != "?" && smart_array[i].chain_offset_countdown > 0;
+      local_result |= smart_array[i].at_chain != "?" && smart_array[i].state.chain_offset_countdown > 0;
     #endif
-    if (!raw || local_result) {
-      count++;
-      json_object[String(count)]["smart"] = smart_array[i].smart_string;
+    if (raw && !local_result) {
+      continue;
     }
+    output.print(++count > 0 ? ",\"" : "\"");
+    output.print(count);
+    output.print("\":{");
+    first = true;
+    printJsonKey(output, first, "smart");
+    printJsonText(output, smart_array[i].smart_string);
     if (!raw) {
+      printJsonKey(output, first, "id");
+      output.print(smart_array[i].state.id);
       if (!smart_array[i].enabled) {
-        json_object[String(count)]["enabled"] = false;
+        printJsonKey(output, first, "enabled");
+        output.print("false");
       }
-      if (smart_array[i].days != "ouehras") {
-        json_object[String(count)]["days"] = smart_array[i].days;
+      if (smart_array[i].days != every_day) {
+        printJsonKey(output, first, "days");
+        printJsonText(output, getSmartDays(smart_array[i].days));
       }
       #if defined(light_switch) || defined(blinds)
-        if (smart_array[i].what != "?") {
-          json_object[String(count)]["what"] = smart_array[i].what.toInt();
+        if (smart_array[i].what != 0) {
+          printJsonKey(output, first, "what");
+          output.print(getSmartWhat(smart_array[i].what));
         }
       #endif
-      if (smart_array[i].action != "?") {
-        if (strContains(smart_array[i].action, ";") && !strContains(smart_array[i].action, ".")) {
+      #ifdef blinds
+        if (smart_array[i].action.type == smart_action_wings) {
+          printJsonKey(output, first, "action");
           for (int j = 0; j < 3; j++) {
-            json_object[String(count)]["action"][j] = get1(smart_array[i].action, j, ';').toInt();
+            output.print(j == 0 ? "[" : ",");
+            output.print(smart_array[i].action.value[j]);
           }
+          output.print("]");
         } else {
-          json_object[String(count)]["action"] = smart_array[i].action;
+          if (getSmartAction(smart_array[i].smart_string) != "?") {
+            printJsonKey(output, first, "action");
+            printJsonText(output, getSmartAction(smart_array[i].smart_string));
+          }
         }
-      }
+      #else
+        if (smart_array[i].action != "?") {
+          printJsonKey(output, first, "action");
+          if (strContains(smart_array[i].action, ";") && !strContains(smart_array[i].action, ".")) {
+            for (int j = 0; j < 3; j++) {
+              output.print(j == 0 ? "[" : ",");
+              output.print(get1(smart_array[i].action, j, ';').toInt());
+            }
+            output.print("]");
+          } else {
+            printJsonText(output, smart_array[i].action);
+          }
+        }
+      #endif
       if (smart_array[i].any_trigger_required) {
-        json_object[String(count)]["any_trigger_required"] = true;
+        printJsonKey(output, first, "any_trigger_required");
+        output.print("true");
       }
       if (smart_array[i].at_time > -1) {
-        json_object[String(count)]["at_time"] = String(smart_array[i].at_time / 60) + ":" + (smart_array[i].at_time % 60 < 10 ? "0" + String(smart_array[i].at_time % 60) : String(smart_array[i].at_time % 60));
+        printJsonKey(output, first, "at_time");
+        printJsonTime(output, smart_array[i].at_time);
       }
       if (smart_array[i].start_time > -1 && smart_array[i].end_time > -1) {
-          json_object[String(count)]["between_hours"][0] = String(smart_array[i].start_time / 60) + ":" + (smart_array[i].start_time % 60 < 10 ? "0" + String(smart_array[i].start_time % 60) : String(smart_array[i].start_time % 60));
-          json_object[String(count)]["between_hours"][1] = String(smart_array[i].end_time / 60) + ":" + (smart_array[i].end_time % 60 < 10 ? "0" + String(smart_array[i].end_time % 60) : String(smart_array[i].end_time % 60));
+        printJsonKey(output, first, "between_hours");
+        output.print("[");
+        printJsonTime(output, smart_array[i].start_time);
+        output.print(",");
+        printJsonTime(output, smart_array[i].end_time);
+        output.print("]");
       } else {
         if (smart_array[i].start_time > -1) {
-          json_object[String(count)]["start_time"] = String(smart_array[i].start_time / 60) + ":" + (smart_array[i].start_time % 60 < 10 ? "0" + String(smart_array[i].start_time % 60) : String(smart_array[i].start_time % 60));
+          printJsonKey(output, first, "start_time");
+          printJsonTime(output, smart_array[i].start_time);
         }
         if (smart_array[i].end_time > -1) {
-          json_object[String(count)]["end_time"] = String(smart_array[i].end_time / 60) + ":" + (smart_array[i].end_time % 60 < 10 ? "0" + String(smart_array[i].end_time % 60) : String(smart_array[i].end_time % 60));
+          printJsonKey(output, first, "end_time");
+          printJsonTime(output, smart_array[i].end_time);
         }
       }
     }
     if (smart_array[i].at_sunset) {
       if (!raw) {
-        json_object[String(count)]["at_sunset"] = true;
+        printJsonKey(output, first, "at_sunset");
+        output.print("true");
         if (smart_array[i].sunset_offset != 0) {
-          json_object[String(count)]["sunset_offset"] = smart_array[i].sunset_offset;
+          printJsonKey(output, first, "sunset_offset");
+          output.print(smart_array[i].sunset_offset);
         }
       }
-      if (smart_array[i].has_lowering_at_sunset_offset) {
-        json_object[String(count)]["has_lowering_at_sunset_offset"] = true;
+      if (smart_array[i].state.has_lowering_at_sunset_offset) {
+        printJsonKey(output, first, "has_lowering_at_sunset_offset");
+        output.print("true");
       }
     }
     if (smart_array[i].at_sunrise && !raw) {
-      json_object[String(count)]["at_sunrise"] = true;
+      printJsonKey(output, first, "at_sunrise");
+      output.print("true");
       if (smart_array[i].sunrise_offset != 0) {
-        json_object[String(count)]["sunrise_offset"] = smart_array[i].sunrise_offset;
+        printJsonKey(output, first, "sunrise_offset");
+        output.print(smart_array[i].sunrise_offset);
       }
     }
     if (smart_array[i].at_dusk > -1) {
       if (!raw) {
+        printJsonKey(output, first, "at_dusk");
         if (smart_array[i].at_dusk > 0) {
-          json_object[String(count)]["at_dusk"] = smart_array[i].at_dusk;
+          output.print(smart_array[i].at_dusk);
         } else {
-          json_object[String(count)]["at_dusk"] = true;
+          output.print("true");
         }
         if (smart_array[i].dusk_offset > 0) {
-          json_object[String(count)]["dusk_offset"] = smart_array[i].dusk_offset;
+          printJsonKey(output, first, "dusk_offset");
+          output.print(smart_array[i].dusk_offset);
         }
       }
-      if (smart_array[i].local_dusk_time > 0) {
+      if (smart_array[i].state.local_dusk_time > 0) {
+        printJsonKey(output, first, "local_dusk_time");
         if (raw) {
-          json_object[String(count)]["local_dusk_time"] = smart_array[i].local_dusk_time;
+          output.print(smart_array[i].state.local_dusk_time);
         } else {
-          json_object[String(count)]["local_dusk_time"] = String(smart_array[i].local_dusk_time / 60) + ":" + (smart_array[i].local_dusk_time % 60 < 10 ? "0" + String(smart_array[i].local_dusk_time % 60) : String(smart_array[i].local_dusk_time % 60));
+          printJsonTime(output, smart_array[i].state.local_dusk_time);
         }
       }
-      if (smart_array[i].dusk_day > -1) {
-        if (smart_array[i].dusk_day > 0 || raw) {
-          json_object[String(count)]["dusk_day"] = smart_array[i].dusk_day;
+      if (smart_array[i].state.dusk_day > -1) {
+        if (smart_array[i].state.dusk_day > 0 || raw) {
+          printJsonKey(output, first, "dusk_day");
+          output.print(smart_array[i].state.dusk_day);
         } else {
-          json_object[String(count)]["dusk_log"] = true;
+          printJsonKey(output, first, "dusk_log");
+          output.print("true");
         }
       }
     }
     if (smart_array[i].at_dawn > -1) {
       if (!raw) {
+        printJsonKey(output, first, "at_dawn");
         if (smart_array[i].at_dawn > 0) {
-          json_object[String(count)]["at_dawn"] = smart_array[i].at_dawn;
+          output.print(smart_array[i].at_dawn);
         } else {
-          json_object[String(count)]["at_dawn"] = true;
+          output.print("true");
         }
         if (smart_array[i].dawn_offset > 0) {
-          json_object[String(count)]["dawn_offset"] = smart_array[i].dawn_offset;
+          printJsonKey(output, first, "dawn_offset");
+          output.print(smart_array[i].dawn_offset);
         }
       }
-      if (smart_array[i].local_dawn_time > 0) {
+      if (smart_array[i].state.local_dawn_time > 0) {
+        printJsonKey(output, first, "local_dawn_time");
         if (raw) {
-          json_object[String(count)]["local_dawn_time"] = smart_array[i].local_dawn_time;
+          output.print(smart_array[i].state.local_dawn_time);
         } else {
-          json_object[String(count)]["local_dawn_time"] = String(smart_array[i].local_dawn_time / 60) + ":" + (smart_array[i].local_dawn_time % 60 < 10 ? "0" + String(smart_array[i].local_dawn_time % 60) : String(smart_array[i].local_dawn_time % 60));
+          printJsonTime(output, smart_array[i].state.local_dawn_time);
         }
       }
-      if (smart_array[i].dawn_day > -1) {
-        if (smart_array[i].dawn_day > 0 || raw) {
-          json_object[String(count)]["dawn_day"] = smart_array[i].dawn_day;
+      if (smart_array[i].state.dawn_day > -1) {
+        if (smart_array[i].state.dawn_day > 0 || raw) {
+          printJsonKey(output, first, "dawn_day");
+          output.print(smart_array[i].state.dawn_day);
         } else {
-          json_object[String(count)]["dawn_log"] = true;
+          printJsonKey(output, first, "dawn_log");
+          output.print("true");
         }
       }
     }
     #ifdef light_switch
       if (smart_array[i].at_switch != "?") {
         if (!raw) {
-          json_object[String(count)]["at_switch"] = smart_array[i].at_switch;
+          printJsonKey(output, first, "at_switch");
+          printJsonText(output, smart_array[i].at_switch);
           if (smart_array[i].switch_offset > 0) {
-            json_object[String(count)]["switch_offset"] = smart_array[i].switch_offset;
+            printJsonKey(output, first, "switch_offset");
+            output.print(smart_array[i].switch_offset);
           }
         }
-        if (smart_array[i].switch_offset_countdown > 0) {
-          json_object[String(count)]["switch_offset_countdown"] = smart_array[i].switch_offset_countdown;
+        if (smart_array[i].state.switch_offset_countdown > 0) {
+          printJsonKey(output, first, "switch_offset_countdown");
+          output.print(smart_array[i].state.switch_offset_countdown);
         }
       }
     #endif
     #ifdef blinds
-      if (smart_array[i].at_blinds != "?") {
+      if (smart_array[i].at_blinds[0] > -1) {
         if (!raw) {
-          json_object[String(count)]["at_blinds"] = smart_array[i].at_blinds;
+          printJsonKey(output, first, "at_blinds");
+          output.print("\"");
+          output.print(smart_array[i].at_blinds[0]);
+          if (smart_array[i].at_blinds[0] != smart_array[i].at_blinds[1] || smart_array[i].at_blinds[1] != smart_array[i].at_blinds[2]) {
+            output.print(";");
+            output.print(smart_array[i].at_blinds[1]);
+            output.print(";");
+            output.print(smart_array[i].at_blinds[2]);
+          }
+          output.print("\"");
           if (smart_array[i].blinds_offset > 0) {
-            json_object[String(count)]["blinds_offset"] = smart_array[i].blinds_offset;
+            printJsonKey(output, first, "blinds_offset");
+            output.print(smart_array[i].blinds_offset);
           }
         }
-        if (smart_array[i].blinds_offset_countdown > 0) {
-          json_object[String(count)]["blinds_offset_countdown"] = smart_array[i].blinds_offset_countdown;
+        if (smart_array[i].state.blinds_offset_countdown > 0) {
+          printJsonKey(output, first, "blinds_offset_countdown");
+          output.print(smart_array[i].state.blinds_offset_countdown);
         }
       }
+      if (smart_array[i].sun_facade > -1 && !raw) {
+        printJsonKey(output, first, "at_sun");
+        output.print("\"");
+        output.print(smart_array[i].sun_facade);
+        output.print(";");
+        output.print(smart_array[i].sun_range);
+        output.print(";");
+        output.print(smart_array[i].sun_height);
+        output.print("\"");
+      }
     #endif
     #ifdef thermostat
       if (smart_array[i].at_thermostat != "?") {
         if (!raw) {
-          json_object[String(count)]["at_thermostat"] = smart_array[i].at_thermostat;
+          printJsonKey(output, first, "at_thermostat");
+          printJsonText(output, smart_array[i].at_thermostat);
           if (smart_array[i].thermostat_offset > 0) {
-            json_object[String(count)]["thermostat_offset"] = smart_array[i].thermostat_offset;
+            printJsonKey(output, first, "thermostat_offset");
+            output.print(smart_array[i].thermostat_offset);
           }
         }
-        if (smart_array[i].thermostat_offset_countdown > 0) {
-          json_object[String(count)]["thermostat_offset_countdown"] = smart_array[i].thermostat_offset_countdown;
+        if (smart_array[i].state.thermostat_offset_countdown > 0) {
+          printJsonKey(output, first, "thermostat_offset_countdown");
+          output.print(smart_array[i].state.thermostat_offset_countdown);
         }
       }
     #endif
     #ifdef chain
       if (smart_array[i].at_chain != "?") {
         if (!raw) {
-          json_object[String(count)]["at_chain"] = smart_array[i].at_chain;
+          printJsonKey(output, first, "at_chain");
+          printJsonText(output, smart_array[i].at_chain);
           if (smart_array[i].chain_offset > 0) {
-            json_object[String(count)]["chain_offset"] = smart_array[i].chain_offset;
+            printJsonKey(output, first, "chain_offset");
+            output.print(smart_array[i].chain_offset);
           }
         }
-        if (smart_array[i].chain_offset_countdown > 0) {
-          json_object[String(count)]["chain_offset_countdown"] = smart_array[i].chain_offset_countdown;
+        if (smart_array[i].state.chain_offset_countdown > 0) {
+          printJsonKey(output, first, "chain_offset_countdown");
+          output.print(smart_array[i].state.chain_offset_countdown);
         }
       }
     #endif
-    if (smart_array[i].must_be_ != "?" && !raw) {
-      json_object[String(count)]["must_be"] = smart_array[i].must_be_;
-    }
-    if (smart_array[i].twilight_must_be_ != "?" && !raw) {
-      json_object[String(count)]["twilight_must_be"] = smart_array[i].twilight_must_be_;
+    #ifdef blinds
+      if (hasSmartCondition(i) && !raw) {
+        printJsonKey(output, first, "must_be");
+        printJsonText(output, getSmartParameter(smart_array[i].smart_string, "r("));
+      }
+    #else
+      if (hasSmartCondition(i) && !raw) {
+        printJsonKey(output, first, "must_be");
+        printJsonText(output, smart_array[i].must_be_);
+      }
+    #endif
+    if (smart_array[i].twilight_must_be_ != 0 && !raw) {
+      printJsonKey(output, first, "twilight_must_be");
+      printJsonText(output, getSmartParameter(smart_array[i].smart_string, "r2("));
     }
-    if (smart_array[i].lead_u_time > 0) {
+    if (smart_array[i].state.lead_u_time > 0) {
+      printJsonKey(output, first, "lead_time");
       if (raw) {
-        json_object[String(count)]["lead_time"] = smart_array[i].lead_u_time;
+        output.print(smart_array[i].state.lead_u_time);
       } else {
-        DateTime lead_dt(smart_array[i].lead_u_time + offset + (dst ? 3600 : 0));
-        json_object[String(count)]["lead_time"] = String(lead_dt.year()) + "-" + corectDateTime(lead_dt.month()) + "-" + corectDateTime(lead_dt.day()) + " " + corectDateTime(lead_dt.hour()) + ":" + corectDateTime(lead_dt.minute());
+        DateTime lead_dt(smart_array[i].state.lead_u_time + offset + (dst ? 3600 : 0));
+        printJsonText(output, String(lead_dt.year()) + "-" + corectDateTime(lead_dt.month()) + "-" + corectDateTime(lead_dt.day()) + " " + corectDateTime(lead_dt.hour()) + ":" + corectDateTime(lead_dt.minute()));
       }
     }
+    output.print("}");
   }
   if (raw) {
-    json_object["count"] = count + 1;
+    output.print(count > -1 ? ",\"count\":" : "\"count\":");
+    output.print(count + 1);
+  }
+  output.print("}");
+}
+
+void saveSmartState() {
+  File file = LittleFS.open("/smart.bin", "w");
+  if (!file) {
+    return;
   }
 
-  return json_object;
+  for (int i = 0; i < smart_count; i++) {
+    file.write((const uint8_t*)&smart_array[i].state, sizeof(SmartState));
+  }
+  file.close();
 }
 
-void readSmart() {
-  File file = LittleFS.open("/smart.txt", "r");
+void readSmartState() {
+  if (LittleFS.exists("/smart.txt")) {
+    migrateSmartState();
+    return;
+  }
+
+  File file = LittleFS.open("/smart.bin", "r");
   if (!file) {
     return;
   }
 
-  DynamicJsonDocument json_object(smart_count * 400);
-  DeserializationError deserialization_error = deserializeJson(json_object, file);
+  SmartState record;
+  int result = 0;
+  int i = 0;
+  while (file.read((uint8_t*)&record, sizeof(SmartState)) == sizeof(SmartState)) {
+    if (i >= smart_count || smart_array[i].state.id != record.id) { // The rules were edited, look the record up.
+      i = 0;
+      while (i < smart_count && smart_array[i].state.id != record.id) {
+        i++;
+      }
+    }
+    if (i < smart_count) {
+      smart_array[i++].state = record;
+      result++;
+    }
+  }
+  file.close();
 
-  if (deserialization_error) {
-    note("Smart file error: " + String(deserialization_error.f_str()));
-    file.close();
+  if (result > 0) {
+    note(String(result) + "/" + String(smart_count) + " Smart(s) restored");
+  }
+}
+
+void migrateSmartState() { // Moves the state kept in /smart.txt by earlier versions into /smart.bin, once.
+  File file = LittleFS.open("/smart.txt", "r");
+  if (!file) {
     return;
   }
 
+  DynamicJsonDocument json_object(smart_count * 400 + 64);
+  DeserializationError deserialization_error = deserializeJson(json_object, file);
   file.close();
+  LittleFS.remove("/smart.txt");
 
-  if (!(json_object.containsKey("count") && json_object["count"].as<int>() > 0)) {
+  if (deserialization_error) {
+    note("Smart file error: " + String(deserialization_error.f_str()));
     return;
   }
 
   int count = json_object["count"].as<int>();
   JsonObject json_object_2;
   int result = 0;
-  int i = -1;
-  while (++i < smart_count) {
+  for (int i = 0; i < smart_count; i++) {
     for (int j = 0; j < count; j++) {
       json_object_2 = json_object[String(j)];
-      if (smart_array[i].smart_string == json_object_2["smart"].as<String>()) {
-        smart_array[i].has_lowering_at_sunset_offset = json_object_2.containsKey("has_lowering_at_sunset_offset");
-        if (json_object_2.containsKey("local_dusk_time")) {
-          smart_array[i].local_dusk_time = json_object_2["local_dusk_time"].as<int>();
-        }
-        if (json_object_2.containsKey("dusk_day")) {
-          smart_array[i].dusk_day = json_object_2["dusk_day"].as<int>();
+      if (smart_array[i].smart_string != json_object_2["smart"].as<String>()) {
+        continue;
+      }
+      SmartState& state = smart_array[i].state;
+      state.has_lowering_at_sunset_offset = json_object_2.containsKey("has_lowering_at_sunset_offset");
+      if (json_object_2.containsKey("local_dusk_time")) {
+        state.local_dusk_time = json_object_2["local_dusk_time"].as<int>();
+      }
+      if (json_object_2.containsKey("dusk_day")) {
+        state.dusk_day = json_object_2["dusk_day"].as<int>();
+      }
+      if (json_object_2.containsKey("local_dawn_time")) {
+        state.local_dawn_time = json_object_2["local_dawn_time"].as<int>();
+      }
+      if (json_object_2.containsKey("dawn_day")) {
+        state.dawn_day = json_object_2["dawn_day"].as<int>();
+      }
+      #ifdef light_switch
+        if (json_object_2.containsKey("switch_offset_countdown")) {
+          state.switch_offset_countdown = json_object_2["switch_offset_countdown"].as<int>();
         }
-        if (json_object_2.containsKey("local_dawn_time")) {
-          smart_array[i].local_dawn_time = json_object_2["local_dawn_time"].as<int>();
+      #endif
+      #ifdef blinds
+        if (json_object_2.containsKey("blinds_offset_countdown")) {
+          state.blinds_offset_countdown = json_object_2["blinds_offset_countdown"].as<int>();
         }
-        if (json_object_2.containsKey("dawn_day")) {
-          smart_array[i].dawn_day = json_object_2["dawn_day"].as<int>();
+      #endif
+      #ifdef thermostat
+        if (json_object_2.containsKey("thermostat_offset_countdown")) {
+          state.thermostat_offset_countdown = json_object_2["thermostat_offset_countdown"].as<int>();
         }
-        #ifdef light_switch
-          if (json_object_2.containsKey("switch_offset_countdown")) {
-            smart_array[i].switch_offset_countdown = json_object_2["switch_offset_countdown"].as<int>();
-          }
-        #endif
-        #ifdef blinds
-          if (json_object_2.containsKey("blinds_offset_countdown")) {
-            smart_array[i].blinds_offset_countdown = json_object_2["blinds_offset_countdown"].as<int>();
-          }
-        #endif
-        #ifdef thermostat
-          if (json_object_2.containsKey("thermostat_offset_countdown")) {
-            smart_array[i].thermostat_offset_countdown = json_object_2["thermostat_offset_countdown"].as<int>();
-          }
-        #endif
-        #ifdef chain
-          if (json_object_2.containsKey("chain_offset_countdown")) {
-            smart_array[i].chain_offset_countdown = json_object_2["chain_offset_countdown"].as<int>();
-          }
-        #endif
-        if (json_object_2.containsKey("lead_time")) {
-          smart_array[i].lead_u_time = json_object_2["lead_time"].as<int>();
+      #endif
+      #ifdef chain
+        if (json_object_2.containsKey("chain_offset_countdown")) {
+          state.chain_offset_countdown = json_object_2["chain_offset_countdown"].as<int>();
         }
-        result++;
+      #endif
+      if (json_object_2.containsKey("lead_time")) {
+        state.lead_u_time = json_object_2["lead_time"].as<uint32_t>();
       }
+      result++;
+      break;
     }
   }
+
   if (result > 0) {
-    note(String(result) + "/" + String(smart_count) + " Smart(s) restored");
+    saveSmartState();
+    note(String(result) + "/" + String(smart_count) + " Smart(s) moved to smart.bin");
   }
 }
 
 void setSmart(const String& smart_string) {
   if (smart_string.length() < 2) {
     smart_count = 0;
+    smart_timeline_update = true; // The timeline and its subscribers still point at the old rules.
     return;
   }
 
@@ -725,208 +1226,677 @@ void setSmart(const String& smart_string) {
     delete [] smart_array;
   }
   smart_array = new Smart[smart_count];
+  smart_capacity = smart_count;
   smart_count = 0;
+  smart_timeline_update = true;
 
   String single_smart_string;
 
   for (int i = 0; i < count; i++) {
     single_smart_string = get1(smart_string, i, ',');
     if (smart_prefix == single_smart_string.charAt(0)) {
-      smart_array[smart_count].smart_string = single_smart_string;
-      smart_array[smart_count].enabled = !strContains(single_smart_string, "/");
+      compileSmart(smart_array[smart_count++], single_smart_string);
+    }
+  }
+  readSmartState();
+}
 
-      String substring = single_smart_string.substring(0, single_smart_string.indexOf(strContains(single_smart_string, "|") ? "|" : "&"));
-      smart_array[smart_count].days = strContains(substring, "o") ? "o" : "";
-      smart_array[smart_count].days += strContains(substring, "u") ? "u" : "";
-      smart_array[smart_count].days += strContains(substring, "e") ? "e" : "";
-      smart_array[smart_count].days += strContains(substring, "h") ? "h" : "";
-      smart_array[smart_count].days += strContains(substring, "r") ? "r" : "";
-      smart_array[smart_count].days += strContains(substring, "a") ? "a" : "";
-      smart_array[smart_count].days += strContains(substring, "s") ? "s" : "";
-      if (smart_array[smart_count].days == "") {
-        smart_array[smart_count].days = "ouehras";
-      }
+int findSmart(uint32_t id) {
+  for (int i = 0; i < smart_count; i++) {
+    if (smart_array[i].state.id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
 
-      #if defined(light_switch) || defined(blinds)
-        smart_array[smart_count].what = strContains(substring, 1) ? "1" : "";
-        smart_array[smart_count].what += strContains(substring, 2) ? "2" : "";
-        smart_array[smart_count].what += strContains(substring, 3) ? "3" : "";
-        smart_array[smart_count].what += strContains(substring, 4) ? "123" : "";
-        if (smart_array[smart_count].what == "") {
-          smart_array[smart_count].what = "?";
-        }
-      #endif
+int checkSmartOperation(char operation, uint32_t id, const String& single_smart_string) { // HTTP status of the change.
+  if (operation == 'a' || operation == 'r') {
+    if (single_smart_string.charAt(0) != smart_prefix || strContains(single_smart_string, ",")) {
+      return 400;
+    }
+  }
+  if (operation != 'a' && findSmart(id) < 0) {
+    return 404;
+  }
+  if (operation == 'a' || operation == 'r') {
+    Smart smart;
+    compileSmart(smart, single_smart_string);
+    int same = findSmart(smart.state.id);
+    if (same > -1 && (operation == 'a' || smart.state.id != id)) {
+      return 409; // The id is taken from the definition, so two equal rules can't be told apart.
+    }
+  }
+  return 200;
+}
 
-      smart_array[smart_count].any_trigger_required = strContains(single_smart_string, "&");
+uint32_t applySmartOperation(char operation, uint32_t id, const String& single_smart_string) {
+  if (checkSmartOperation(operation, id, single_smart_string) != 200) {
+    return 0;
+  }
 
-      smart_array[smart_count].action = "?";
-      if (smart_array[smart_count].any_trigger_required) {
-        if (strContains(single_smart_string, "|")) {
-          smart_array[smart_count].action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.indexOf("&"));
-        }
-        single_smart_string = single_smart_string.substring(single_smart_string.indexOf("&") + 1);
-      } else {
-        if (single_smart_string.indexOf("|") != single_smart_string.lastIndexOf("|")) {
-          smart_array[smart_count].action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.lastIndexOf("|"));
-        }
-        single_smart_string = single_smart_string.substring(single_smart_string.lastIndexOf("|") + 1);
-      }
+  int index = operation == 'a' ? smart_count : findSmart(id);
 
-      smart_array[smart_count].twilight_must_be_ = "?";
-      if (strContains(single_smart_string, "r2(")) {
-        substring = single_smart_string.substring(single_smart_string.indexOf("r2("), single_smart_string.indexOf(")", single_smart_string.indexOf("r2(")) + 1);
-        smart_array[smart_count].twilight_must_be_ = substring.substring(substring.indexOf("r2(") + 3, substring.indexOf(")", substring.indexOf("r2(")));
-        single_smart_string.replace(substring, "");
+  if (operation == 'a') {
+    if (smart_count == smart_capacity) {
+      smart_capacity = smart_capacity * 2 + 4;
+      Smart *new_smart_array = new Smart[smart_capacity];
+      for (int i = 0; i < smart_count; i++) {
+        new_smart_array[i] = smart_array[i];
       }
-
-      smart_array[smart_count].must_be_ = "?";
-      if (strContains(single_smart_string, "r(")) {
-        smart_array[smart_count].must_be_ = single_smart_string.substring(single_smart_string.indexOf("r(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("r(")));
+      if (smart_array != 0) {
+        delete [] smart_array;
       }
+      smart_array = new_smart_array;
+    }
+    smart_count++;
+  }
+  if (operation == 'a' || operation == 'r') {
+    compileSmart(smart_array[index], single_smart_string);
+  }
+  if (operation == 'e' && !smart_array[index].enabled) {
+    smart_array[index].enabled = true;
+    smart_array[index].smart_string.replace("/", "");
+  }
+  if (operation == 'd' && smart_array[index].enabled) {
+    smart_array[index].enabled = false;
+    smart_array[index].smart_string += "/";
+  }
+  if (operation == 'x') {
+    smart_count--;
+    for (int i = index; i < smart_count; i++) { // Keeps the order the rules were set in.
+      smart_array[i] = smart_array[i + 1];
+    }
+  }
 
-      smart_array[smart_count].at_time = -1;
-      if (strContains(single_smart_string, "_")) {
-        smart_array[smart_count].at_time = isStringDigit(single_smart_string.substring(0, single_smart_string.indexOf("_")), "-1").toInt();
-      }
+  smart_timeline_update = true;
+  state_generation++;
+  return operation == 'x' ? id : smart_array[index].state.id;
+}
 
-      smart_array[smart_count].start_time = -1;
-      smart_array[smart_count].end_time = -1;
-      if (strContains(single_smart_string, "h(")) {
-        smart_array[smart_count].start_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("h(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("h("))), "-1").toInt();
-        smart_array[smart_count].end_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("h(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("h("))), "-1").toInt();
-      }
+void logSmartOperation(char operation, uint32_t id, const String& single_smart_string) {
+  File file = LittleFS.open("/smart.log", "a");
+  if (!file) {
+    return;
+  }
 
-      smart_array[smart_count].at_sunset = strContains(single_smart_string, "n");
-      smart_array[smart_count].sunset_offset = 0;
-      smart_array[smart_count].has_lowering_at_sunset_offset = false;
-      if (strContains(single_smart_string, "n(")) {
-        smart_array[smart_count].sunset_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("n(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("n("))), "0").toInt();
-      }
+  file.print(String(settings_generation) + " " + operation + " " + String(id) + " " + single_smart_string + "\n");
+  file.close();
+  if (++smart_log_count >= smart_log_limit) {
+    saveSettings(false);
+  }
+}
 
-      smart_array[smart_count].at_sunrise = strContains(single_smart_string, "d");
-      smart_array[smart_count].sunrise_offset = 0;
-      if (strContains(single_smart_string, "d(")) {
-        smart_array[smart_count].sunrise_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("d(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("d("))), "0").toInt();
-      }
+void replaySmartLog() {
+  File file = LittleFS.open("/smart.log", "r");
+  if (!file) {
+    return;
+  }
 
-      smart_array[smart_count].at_dusk = -1;
-      smart_array[smart_count].local_dusk_time = -1;
-      smart_array[smart_count].dusk_offset = 0;
-      smart_array[smart_count].dusk_day = 0;
-      if (strContains(single_smart_string, "<")) {
-        smart_array[smart_count].at_dusk = 0;
-        if (strContains(single_smart_string, "<(")) {
-          smart_array[smart_count].at_dusk = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("<(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("<("))), "0").toInt();
-          smart_array[smart_count].dusk_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("<(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("<("))), "0").toInt();
-        }
-      }
+  String line;
+  int result = 0;
+  while (file.available()) {
+    line = file.readStringUntil('\n');
+    if ((uint32_t)line.toInt() != settings_generation) { // Already in the settings file.
+      continue;
+    }
+    line = line.substring(line.indexOf(" ") + 1);
+    char operation = line.charAt(0);
+    line = line.substring(2);
+    uint32_t id = strtoul(line.c_str(), nullptr, 10);
+    if (applySmartOperation(operation, id, line.substring(line.indexOf(" ") + 1)) > 0) {
+      result++;
+    }
+  }
+  file.close();
 
-      smart_array[smart_count].at_dawn = -1;
-      smart_array[smart_count].local_dawn_time = -1;
-      smart_array[smart_count].dawn_offset = 0;
-      smart_array[smart_count].dawn_day = 0;
-      if (strContains(single_smart_string, ">")) {
-        smart_array[smart_count].at_dawn = 0;
-        if (strContains(single_smart_string, ">(")) {
-          smart_array[smart_count].at_dawn = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(">(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf(">("))), "0").toInt();
-          smart_array[smart_count].dawn_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf(">(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf(">("))), "0").toInt();
-        }
-      }
+  smart_log_count = result;
+  if (result > 0) {
+    note(String(result) + " Smart change(s) restored");
+  }
+}
 
-      if (strContains(single_smart_string, "z")) {
-        smart_array[smart_count].at_dusk = 0;
-        smart_array[smart_count].local_dusk_time = -1;
-        smart_array[smart_count].dusk_day = -1;
-        smart_array[smart_count].at_dawn = 0;
-        smart_array[smart_count].local_dawn_time = -1;
-        smart_array[smart_count].dawn_day = -1;
-        if (strContains(single_smart_string, "z(")) {
-          smart_array[smart_count].dusk_offset = single_smart_string.substring(single_smart_string.indexOf("z(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("z("))).toInt();
-          smart_array[smart_count].dawn_offset = smart_array[smart_count].dusk_offset;
-        }
+void clearSmartLog() {
+  if (smart_log_count > 0 || LittleFS.exists("/smart.log")) {
+    LittleFS.remove("/smart.log");
+  }
+  smart_log_count = 0;
+}
+
+void compileSmart(Smart& smart, String single_smart_string) {
+  smart.smart_string = single_smart_string;
+  smart.enabled = !strContains(single_smart_string, "/");
+
+  String substring = single_smart_string.substring(0, single_smart_string.indexOf(strContains(single_smart_string, "|") ? "|" : "&"));
+  smart.days = 0;
+  for (int i = 0; i < 7; i++) {
+    if (strContains(substring, days_of_the_week[i])) {
+      smart.days |= 1 << i;
+    }
+  }
+  if (smart.days == 0) {
+    smart.days = every_day;
+  }
+
+  #if defined(light_switch) || defined(blinds)
+    smart.what = strContains(substring, 4) ? 7 : 0;
+    for (int i = 0; i < 3; i++) {
+      if (strContains(substring, i + 1)) {
+        smart.what |= 1 << i;
       }
+    }
+  #endif
 
-      #ifdef light_switch
-        smart_array[smart_count].at_switch = "?";
-        smart_array[smart_count].switch_offset = 0;
-        smart_array[smart_count].switch_offset_countdown = -1;
-        if (strContains(single_smart_string, "l(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("l("), single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), ";")) {
-            smart_array[smart_count].at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("l(")));
-            smart_array[smart_count].switch_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("l(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("l(")));
-          }
-        }
-      #endif
+  smart.any_trigger_required = strContains(single_smart_string, "&");
 
-      #ifdef blinds
-        smart_array[smart_count].at_blinds = "?";
-        smart_array[smart_count].blinds_offset = 0;
-        smart_array[smart_count].blinds_offset_countdown = -1;
-        if (strContains(single_smart_string, "b(")) {
-        int semicolon = 0;
-        for (char b: smart_string) b == ';' ? semicolon++ : false;
-          if (semicolon == 1 || semicolon == 3) {
-            smart_array[smart_count].at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(0, single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";"));
-            smart_array[smart_count].blinds_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";") + 1), "0").toInt();
-          } else {
-            smart_array[smart_count].at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b(")));
-          }
+  #ifdef blinds
+    String action = getSmartAction(single_smart_string);
+    smart.action.type = smart_action_none;
+    if (strContains(action, ".")) {
+      if (strContains(action, ";") && action.indexOf(".") < action.indexOf(";")) {
+        smart.action.type = smart_action_remote;
+      }
+    } else {
+      if (strContains(action, ";")) {
+        smart.action.type = smart_action_wings;
+        for (int i = 0; i < 3; i++) {
+          smart.action.value[i] = get1(action, i, ';').toInt();
         }
-      #endif
-
-      #ifdef thermostat
-        smart_array[smart_count].at_thermostat = "?";
-        smart_array[smart_count].thermostat_offset = 0;
-        smart_array[smart_count].thermostat_offset_countdown = 0;
-        if (strContains(single_smart_string, "t(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("t("), single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), ";")) {
-            smart_array[smart_count].at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("t("))), "?");
-            smart_array[smart_count].thermostat_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("t(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "?");
+      } else {
+        if (action != "?") {
+          smart.action.type = smart_action_value;
+          for (int i = 0; i < 3; i++) {
+            smart.action.value[i] = action.toInt();
           }
         }
-      #endif
+      }
+    }
+  #else
+    smart.action = getSmartAction(single_smart_string);
+  #endif
 
-      #ifdef chain
-        smart_array[smart_count].at_chain = "?";
-        smart_array[smart_count].chain_offset = 0;
-        smart_array[smart_count].chain_offset_countdown = -1;
-        if (strContains(single_smart_string, "c(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("c("), single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), ";")) {
-            smart_array[smart_count].at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("c(")));
-            smart_array[smart_count].chain_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("c(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), "0").toInt();
+  if (smart.any_trigger_required) {
+    single_smart_string = single_smart_string.substring(single_smart_string.indexOf("&") + 1);
+  } else {
+    single_smart_string = single_smart_string.substring(single_smart_string.lastIndexOf("|") + 1);
+  }
+
+  smart.twilight_must_be_ = 0;
+  if (strContains(single_smart_string, "r2(")) {
+    substring = getSmartParameter(single_smart_string, "r2(");
+    smart.twilight_must_be_ |= strContains(substring, "n") ? twilight_sunset : 0;
+    smart.twilight_must_be_ |= strContains(substring, "d") ? twilight_sunrise : 0;
+    smart.twilight_must_be_ |= strContains(substring, "<") ? twilight_dusk : 0;
+    smart.twilight_must_be_ |= strContains(substring, ">") ? twilight_dawn : 0;
+    single_smart_string.replace("r2(" + substring + ")", "");
+  }
+
+  #ifdef blinds
+    smart.sun_facade = -1;
+    smart.sun_range = 60;
+    smart.sun_height = 0;
+    if (strContains(single_smart_string, "p(")) {
+      substring = getSmartParameter(single_smart_string, "p(");
+      smart.sun_facade = constrain(isStringDigit(get1(substring, 0, ';'), "0").toInt(), 0, 359);
+      smart.sun_range = constrain(isStringDigit(get1(substring, 1, ';'), "60").toInt(), 1, 90);
+      smart.sun_height = constrain(isStringDigit(get1(substring, 2, ';'), "0").toInt(), 0, 90);
+      single_smart_string.replace("p(" + substring + ")", "");
+    }
+
+    for (int i = 0; i < 3; i++) {
+      smart.must_be_[i] = smart_condition_none;
+      smart.must_be_value[i] = 0;
+    }
+    if (strContains(single_smart_string, "r(")) {
+      substring = getSmartParameter(single_smart_string, "r(");
+      String condition;
+      for (int i = 0; i < 3; i++) {
+        condition = strContains(substring, ";") ? get1(substring, i, ';') : substring;
+        if (condition.length() == 0) { // "r(;;<20)" leaves the other wings free.
+          continue;
+        }
+        if (strContains(condition, "<")) {
+          smart.must_be_[i] = smart_condition_below;
+          condition = condition.substring(condition.indexOf("<") + 1);
+        } else {
+          if (strContains(condition, ">")) {
+            smart.must_be_[i] = smart_condition_above;
+            condition = condition.substring(condition.indexOf(">") + 1);
           } else {
-            smart_array[smart_count].at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("c(")));
+            smart.must_be_[i] = smart_condition_equal;
           }
         }
-      #endif
-
-      smart_array[smart_count].lead_u_time = 0;
-      if (strContains(single_smart_string, "e(")) {
-          smart_array[smart_count].lead_u_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("e(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("e("))), "0").toInt();
+        smart.must_be_value[i] = condition.toInt();
       }
-
-      smart_count++;
     }
+  #else
+    smart.must_be_ = getSmartParameter(single_smart_string, "r(");
+  #endif
+
+  smart.at_time = -1;
+  if (strContains(single_smart_string, "_")) {
+    smart.at_time = isStringDigit(single_smart_string.substring(0, single_smart_string.indexOf("_")), "-1").toInt();
   }
-  readSmart();
-}
 
-int verifiedTime(int time) {
-  if (time > 1439) {
-    return 1439 - time;
+  smart.start_time = -1;
+  smart.end_time = -1;
+  if (strContains(single_smart_string, "h(")) {
+    substring = getSmartParameter(single_smart_string, "h(");
+    smart.start_time = isStringDigit(get1(substring, 0, ';'), "-1").toInt();
+    smart.end_time = isStringDigit(get1(substring, 1, ';'), "-1").toInt();
   }
-  return time;
-}
 
-void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_changed ; 1 switch_1 ; 2 switch_2 ; 5 stepper_movement ; 6 temperature_changed
-  if (!RTCisrunning()) {
+  smart.at_sunset = strContains(single_smart_string, "n");
+  smart.sunset_offset = 0;
+  smart.state.has_lowering_at_sunset_offset = false;
+  if (strContains(single_smart_string, "n(")) {
+    smart.sunset_offset = isStringDigit(getSmartParameter(single_smart_string, "n("), "0").toInt();
+  }
+
+  smart.at_sunrise = strContains(single_smart_string, "d");
+  smart.sunrise_offset = 0;
+  if (strContains(single_smart_string, "d(")) {
+    smart.sunrise_offset = isStringDigit(getSmartParameter(single_smart_string, "d("), "0").toInt();
+  }
+
+  smart.at_dusk = -1;
+  smart.state.local_dusk_time = -1;
+  smart.dusk_offset = 0;
+  smart.state.dusk_day = 0;
+  if (strContains(single_smart_string, "<")) {
+    smart.at_dusk = 0;
+    if (strContains(single_smart_string, "<(")) {
+      substring = getSmartParameter(single_smart_string, "<(");
+      smart.at_dusk = isStringDigit(get1(substring, 0, ';'), "0").toInt();
+      smart.dusk_offset = isStringDigit(get1(substring, 1, ';'), "0").toInt();
+    }
+  }
+
+  smart.at_dawn = -1;
+  smart.state.local_dawn_time = -1;
+  smart.dawn_offset = 0;
+  smart.state.dawn_day = 0;
+  if (strContains(single_smart_string, ">")) {
+    smart.at_dawn = 0;
+    if (strContains(single_smart_string, ">(")) {
+      substring = getSmartParameter(single_smart_string, ">(");
+      smart.at_dawn = isStringDigit(get1(substring, 0, ';'), "0").toInt();
+      smart.dawn_offset = isStringDigit(get1(substring, 1, ';'), "0").toInt();
+    }
+  }
+
+  if (strContains(single_smart_string, "z")) {
+    smart.at_dusk = 0;
+    smart.state.local_dusk_time = -1;
+    smart.state.dusk_day = -1;
+    smart.at_dawn = 0;
+    smart.state.local_dawn_time = -1;
+    smart.state.dawn_day = -1;
+    if (strContains(single_smart_string, "z(")) {
+      smart.dusk_offset = getSmartParameter(single_smart_string, "z(").toInt();
+      smart.dawn_offset = smart.dusk_offset;
+    }
+  }
+
+  #ifdef light_switch
+    smart.at_switch = "?";
+    smart.switch_offset = 0;
+    smart.state.switch_offset_countdown = -1;
+    if (strContains(single_smart_string, "l(")) {
+      substring = getSmartParameter(single_smart_string, "l(");
+      if (strContains(substring, ";")) {
+        smart.at_switch = get1(substring, 0, ';');
+        smart.switch_offset = isStringDigit(get1(substring, 1, ';'), "0").toInt();
+      } else {
+        smart.at_switch = substring;
+      }
+    }
+  #endif
+
+  #ifdef blinds
+    for (int i = 0; i < 3; i++) {
+      smart.at_blinds[i] = -1;
+    }
+    smart.blinds_offset = 0;
+    smart.state.blinds_offset_countdown = -1;
+    if (strContains(single_smart_string, "b(")) {
+      substring = getSmartParameter(single_smart_string, "b(");
+      int semicolon = 0;
+      for (char b: substring) {
+        if (b == ';') {
+          semicolon++;
+        }
+      }
+      if (semicolon == 1 || semicolon == 3) {
+        smart.blinds_offset = isStringDigit(substring.substring(substring.lastIndexOf(";") + 1), "0").toInt();
+        substring = substring.substring(0, substring.lastIndexOf(";"));
+      }
+      for (int i = 0; i < 3; i++) {
+        smart.at_blinds[i] = (semicolon > 1 ? get1(substring, i, ';') : substring).toInt();
+      }
+    }
+  #endif
+
+  #ifdef thermostat
+    smart.at_thermostat = "?";
+    smart.thermostat_offset = 0;
+    smart.state.thermostat_offset_countdown = 0;
+    if (strContains(single_smart_string, "t(")) {
+      substring = getSmartParameter(single_smart_string, "t(");
+      if (strContains(substring, ";")) {
+        smart.at_thermostat = isStringDigit(get1(substring, 0, ';'), "?");
+        smart.thermostat_offset = isStringDigit(get1(substring, 1, ';'), "0").toInt();
+      } else {
+        smart.at_thermostat = isStringDigit(substring, "?");
+      }
+    }
+  #endif
+
+  #ifdef chain
+    smart.at_chain = "?";
+    smart.chain_offset = 0;
+    smart.state.chain_offset_countdown = -1;
+    if (strContains(single_smart_string, "c(")) {
+      substring = getSmartParameter(single_smart_string, "c(");
+      if (strContains(substring, ";")) {
+        smart.at_chain = get1(substring, 0, ';');
+        smart.chain_offset = isStringDigit(get1(substring, 1, ';'), "0").toInt();
+      } else {
+        smart.at_chain = substring;
+      }
+    }
+  #endif
+
+  smart.state.lead_u_time = 0;
+  if (strContains(single_smart_string, "e(")) { // Lead time embedded by older versions, it lives in the state record now.
+    substring = getSmartParameter(single_smart_string, "e(");
+    smart.state.lead_u_time = isStringDigit(substring, "0").toInt();
+    smart.smart_string.replace("e(" + substring + ")", "");
+  }
+  substring = smart.smart_string;
+  substring.replace("/", ""); // Enabling or disabling a rule keeps its id.
+  smart.state.id = crc32(substring.c_str(), substring.length());
+
+  smart.inputs = 0;
+  if (smart.start_time > -1 || smart.end_time > -1) {
+    smart.inputs |= 1 << smart_input_level;
+  }
+  if (smart.at_dusk > -1 || smart.at_dawn > -1) {
+    smart.inputs |= 1 << smart_input_light;
+  }
+  #ifdef light_switch
+    if (smart.at_switch != "?") {
+      smart.inputs |= 1 << smart_input_switch | (smart.switch_offset > 0 ? 1 << smart_input_delay : 0);
+    }
+  #endif
+  #ifdef blinds
+    if (smart.at_blinds[0] > -1) {
+      smart.inputs |= 1 << smart_input_position | (smart.blinds_offset > 0 ? 1 << smart_input_delay : 0);
+    }
+    if (smart.sun_facade > -1) {
+      smart.inputs |= 1 << smart_input_sun;
+    }
+  #endif
+  #ifdef thermostat
+    if (smart.at_thermostat != "?") {
+      smart.inputs |= 1 << smart_input_temperature | (smart.thermostat_offset > 0 ? 1 << smart_input_delay : 0);
+    }
+  #endif
+  #ifdef chain
+    if (smart.at_chain != "?") {
+      smart.inputs |= 1 << smart_input_position | (smart.chain_offset > 0 ? 1 << smart_input_delay : 0);
+    }
+  #endif
+}
+
+String getSmartParameter(const String& text, String key) {
+  if (!strContains(text, key)) {
+    return "?";
+  }
+  int start = text.indexOf(key) + key.length();
+  return text.substring(start, text.indexOf(")", start));
+}
+
+String getSmartAction(const String& smart_string) {
+  if (strContains(smart_string, "&")) {
+    if (strContains(smart_string, "|")) {
+      return smart_string.substring(smart_string.indexOf("|") + 1, smart_string.indexOf("&"));
+    }
+  } else {
+    if (smart_string.indexOf("|") != smart_string.lastIndexOf("|")) {
+      return smart_string.substring(smart_string.indexOf("|") + 1, smart_string.lastIndexOf("|"));
+    }
+  }
+  return "?";
+}
+
+String getSmartDays(uint8_t days) {
+  String result = "";
+  for (int i = 1; i < 8; i++) {
+    if (days & (1 << (i % 7))) {
+      result += days_of_the_week[i % 7];
+    }
+  }
+  return result;
+}
+
+#if defined(light_switch) || defined(blinds)
+  String getSmartWhat(uint8_t what) {
+    String result = "";
+    for (int i = 0; i < 3; i++) {
+      if (what & (1 << i)) {
+        result += String(i + 1);
+      }
+    }
+    return result;
+  }
+#endif
+
+#ifdef blinds
+  String getSmartValue(SmartAction action) {
+    if (action.type == smart_action_wings) {
+      return String(action.value[0]) + ";" + String(action.value[1]) + ";" + String(action.value[2]);
+    }
+    return String(action.value[0]);
+  }
+
+  SmartAction getSmartAction(SmartAction action, int fallback) {
+    if (action.type == smart_action_none || action.type == smart_action_remote) {
+      action.type = smart_action_value;
+      for (int i = 0; i < 3; i++) {
+        action.value[i] = fallback;
+      }
+    }
+    return action;
+  }
+#endif
+
+int verifiedTime(int time) {
+  if (time > 1439) {
+    return 1439 - time;
+  }
+  return time;
+}
+
+void buildSmartTimeline(int day) {
+  if (smart_timeline != 0) {
+    delete [] smart_timeline;
+  }
+  if (smart_subscribers != 0) {
+    delete [] smart_subscribers;
+  }
+  if (smart_candidates != 0) {
+    delete [] smart_candidates;
+  }
+  smart_timeline_capacity = smart_count * smart_events;
+  smart_timeline = new SmartEvent[smart_timeline_capacity + 1];
+  smart_candidates = new int[smart_count + 1];
+  smart_timeline_count = 0;
+
+  int subscriptions = 0;
+  for (int input = 0; input < smart_inputs; input++) {
+    smart_subscribers_first[input] = subscriptions;
+    for (int i = 0; i < smart_count; i++) {
+      if (smart_array[i].inputs & (1 << input)) {
+        subscriptions++;
+      }
+    }
+  }
+  smart_subscribers_first[smart_inputs] = subscriptions;
+  smart_subscribers = new int[subscriptions + 1];
+  for (int input = 0; input < smart_inputs; input++) {
+    subscriptions = smart_subscribers_first[input];
+    for (int i = 0; i < smart_count; i++) {
+      if (smart_array[i].inputs & (1 << input)) {
+        smart_subscribers[subscriptions++] = i;
+      }
+    }
+  }
+
+  for (int i = 0; i < smart_count; i++) {
+    addSmartEvent(smart_array[i].at_time, i);
+    if (smart_array[i].at_sunset && next_sunset > -1) {
+      addSmartEvent(verifiedTime(next_sunset + smart_array[i].sunset_offset), i);
+    }
+    if (smart_array[i].at_sunrise && next_sunrise > -1) {
+      addSmartEvent(verifiedTime(next_sunrise + smart_array[i].sunrise_offset), i);
+    }
+    if (smart_array[i].at_dusk > -1 && smart_array[i].dusk_offset > 0 && smart_array[i].state.local_dusk_time > -1) {
+      addSmartEvent(verifiedTime(smart_array[i].state.local_dusk_time + smart_array[i].dusk_offset), i);
+    }
+    if (smart_array[i].at_dawn > -1) {
+      if (smart_array[i].dawn_offset > 0 && smart_array[i].state.local_dawn_time > -1) {
+        addSmartEvent(verifiedTime(smart_array[i].state.local_dawn_time + smart_array[i].dawn_offset), i);
+      }
+      if (next_sunset > -1) {
+        addSmartEvent(next_sunset, i); // Clears has_lowering_at_sunset_offset once the calendar twilight begins.
+      }
+    }
+  }
+
+  SmartEvent event;
+  for (int i = 1; i < smart_timeline_count; i++) {
+    event = smart_timeline[i];
+    int j = i - 1;
+    while (j >= 0 && (smart_timeline[j].time > event.time || (smart_timeline[j].time == event.time && smart_timeline[j].smart > event.smart))) {
+      smart_timeline[j + 1] = smart_timeline[j];
+      j--;
+    }
+    smart_timeline[j + 1] = event;
+  }
+
+  smart_timeline_next = 0;
+  smart_timeline_update = false;
+  timeline_day = day;
+  timeline_time = -1;
+  timeline_sunset = next_sunset;
+  timeline_sunrise = next_sunrise;
+}
+
+void addSmartEvent(int time, int smart) {
+  if (time < 0 || smart_timeline_count == smart_timeline_capacity) {
+    return;
+  }
+  smart_timeline[smart_timeline_count].time = time;
+  smart_timeline[smart_timeline_count].smart = smart;
+  smart_timeline_count++;
+}
+
+int getSmartCandidates(int current_time, int trigger) {
+  uint8_t inputs = 1 << smart_input_level | 1 << smart_input_delay;
+  if (current_time != timeline_time) {
+    inputs |= 1 << smart_input_sun;
+  }
+  if (current_time < timeline_time) {
+    smart_timeline_next = 0;
+  }
+  timeline_time = current_time;
+
+  while (smart_timeline_next < smart_timeline_count && smart_timeline[smart_timeline_next].time < current_time) {
+    smart_timeline_next++;
+  }
+
+  int count = 0;
+  for (int t = smart_timeline_next; t < smart_timeline_count && smart_timeline[t].time == current_time; t++) {
+    count = addSmartCandidate(count, smart_timeline[t].smart);
+  }
+
+  if (trigger == 0) {
+    inputs |= 1 << smart_input_light;
+  }
+  if (trigger == 1 || trigger == 2) {
+    inputs |= 1 << smart_input_switch;
+  }
+  if (trigger == 5) {
+    inputs |= 1 << smart_input_position;
+  }
+  if (trigger == 6) {
+    inputs |= 1 << smart_input_temperature;
+  }
+
+  for (int input = 0; input < smart_inputs; input++) {
+    if (inputs & (1 << input)) {
+      for (int k = smart_subscribers_first[input]; k < smart_subscribers_first[input + 1]; k++) {
+        if (input != smart_input_delay || isSmartCounting(smart_subscribers[k])) {
+          count = addSmartCandidate(count, smart_subscribers[k]);
+        }
+      }
+    }
+  }
+
+  return count;
+}
+
+int addSmartCandidate(int count, int smart) { // Keeps the candidates in rule order, without repeats.
+  int j = count - 1;
+  while (j >= 0 && smart_candidates[j] > smart) {
+    j--;
+  }
+  if (j >= 0 && smart_candidates[j] == smart) {
+    return count;
+  }
+  for (int k = count; k > j + 1; k--) {
+    smart_candidates[k] = smart_candidates[k - 1];
+  }
+  smart_candidates[j + 1] = smart;
+  return count + 1;
+}
+
+bool isSmartCounting(int smart) {
+  #ifdef light_switch
+    return smart_array[smart].state.switch_offset_countdown > -1;
+  #endif
+  #ifdef blinds
+    return smart_array[smart].state.blinds_offset_countdown > -1;
+  #endif
+  #ifdef thermostat
+    return smart_array[smart].state.thermostat_offset_countdown > -1;
+  #endif
+  #ifdef chain
+    return smart_array[smart].state.chain_offset_countdown > -1;
+  #endif
+  return false;
+}
+
+bool hasSmartCondition(int smart) {
+  #ifdef blinds
+    for (int i = 0; i < 3; i++) {
+      if (smart_array[smart].must_be_[i] != smart_condition_none) {
+        return true;
+      }
+    }
+    return false;
+  #else
+    return smart_array[smart].must_be_ != "?";
+  #endif
+}
+
+void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_changed ; 1 switch_1 ; 2 switch_2 ; 5 stepper_movement ; 6 temperature_changed
+  if (!RTCisrunning()) {
     return;
   }
 
+  uint32_t start_us = micros();
   int current_time = -1;
   DateTime now = rtc.now();
   current_time = (now.hour() * 60) + now.minute();
@@ -935,6 +1905,14 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
     return;
   }
 
+  if (smart_timeline_update || timeline_day != now.day() || timeline_sunset != next_sunset || timeline_sunrise != next_sunrise) {
+    buildSmartTimeline(now.day());
+  }
+  if (current_time != timeline_time && smart_subscribers_first[smart_input_sun] != smart_subscribers_first[smart_input_sun + 1]) {
+    getSunPosition(now.unixtime() - offset - (dst ? 3600 : 0));
+  }
+  int candidates_count = getSmartCandidates(current_time, trigger);
+
   int i = -1;
   bool result = false;
   bool local_result;
@@ -952,6 +1930,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
   #endif
   #ifdef blinds
     bool at_blinds_result;
+    bool at_sun_result;
     int new_destination[] = {-1, -1, -1};
   #endif
   #ifdef thermostat
@@ -963,11 +1942,16 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
     bool at_chain_result;
     int new_destination = -1;
   #endif
-  String action;
+  #ifdef blinds
+    SmartAction action;
+  #else
+    String action;
+  #endif
   String log_text = "";
   String local_log = "";
-  while (++i < smart_count) {
-    if (smart_array[i].enabled && strContains(smart_array[i].days, days_of_the_week[now.dayOfTheWeek()])) {
+  for (int k = 0; k < candidates_count; k++) {
+    i = smart_candidates[k];
+    if (smart_array[i].enabled && (smart_array[i].days & (1 << now.dayOfTheWeek()))) {
       local_result = false;
       some_activation = false;
       at_time_result = false;
@@ -982,6 +1966,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       #endif
       #ifdef blinds
         at_blinds_result = false;
+        at_sun_result = false;
       #endif
       #ifdef thermostat
         at_thermostat_result = false;
@@ -989,11 +1974,15 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       #ifdef chain
         at_chain_result = false;
       #endif
-      action = "?";
+      #ifdef blinds
+        action.type = smart_action_none;
+      #else
+        action = "?";
+      #endif
       local_log = "";
 
       if (smart_array[i].at_time > -1) {
-        at_time_result = smart_array[i].at_time == current_time && smart_array[i].lead_u_time + 60 < now.unixtime();
+        at_time_result = smart_array[i].at_time == current_time && smart_array[i].state.lead_u_time + 60 < now.unixtime();
         some_activation |= at_time_result;
         if (!at_time_result && smart_array[i].any_trigger_required) {
           at_time_result = smart_array[i].at_time < current_time;
@@ -1012,7 +2001,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       }
 
       if (smart_array[i].at_sunset && next_sunset > -1) {
-        at_sunset_result = verifiedTime(next_sunset + smart_array[i].sunset_offset) == current_time && smart_array[i].lead_u_time + 60 < now.unixtime();
+        at_sunset_result = verifiedTime(next_sunset + smart_array[i].sunset_offset) == current_time && smart_array[i].state.lead_u_time + 60 < now.unixtime();
         some_activation |= at_sunset_result;
         if (!at_sunset_result && smart_array[i].any_trigger_required) {
           at_sunset_result = (next_sunset + smart_array[i].sunset_offset) < current_time;
@@ -1021,7 +2010,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       }
 
       if (smart_array[i].at_sunrise && next_sunrise > -1) {
-        at_sunrise_result = verifiedTime(next_sunrise + smart_array[i].sunrise_offset) == current_time && smart_array[i].lead_u_time + 60 < now.unixtime();
+        at_sunrise_result = verifiedTime(next_sunrise + smart_array[i].sunrise_offset) == current_time && smart_array[i].state.lead_u_time + 60 < now.unixtime();
         some_activation |= at_sunrise_result;
         if (!at_sunrise_result && smart_array[i].any_trigger_required) {
           at_sunrise_result = (next_sunrise + smart_array[i].sunrise_offset) < current_time;
@@ -1030,64 +2019,66 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       }
 
       if (smart_array[i].at_dusk > -1) {
-        if (smart_array[i].dusk_day > -1 && smart_array[i].dusk_day != now.day() && (smart_array[i].at_dusk == 0 ? !sensor_twilight : smart_array[i].at_dusk < light_sensor)) {
-          smart_array[i].dusk_day = 0;
+        if (smart_array[i].state.dusk_day > -1 && smart_array[i].state.dusk_day != now.day() && (smart_array[i].at_dusk == 0 ? !sensor_twilight : smart_array[i].at_dusk < light_sensor)) {
+          smart_array[i].state.dusk_day = 0;
         }
         at_dusk_result = trigger == 0 && (smart_array[i].at_dusk == 0 ? (twilight_change ? sensor_twilight : false) : smart_array[i].at_dusk > light_sensor);
-        at_dusk_result &= smart_array[i].dusk_day == -1 || smart_array[i].dusk_day == 0;
-        if (at_dusk_result && (smart_array[i].dusk_day == -1 || smart_array[i].dusk_day == 0)) {
-          smart_array[i].local_dusk_time = current_time;
-          if (smart_array[i].dusk_day == 0) {
-            smart_array[i].dusk_day = now.day();
+        at_dusk_result &= smart_array[i].state.dusk_day == -1 || smart_array[i].state.dusk_day == 0;
+        if (at_dusk_result && (smart_array[i].state.dusk_day == -1 || smart_array[i].state.dusk_day == 0)) {
+          smart_array[i].state.local_dusk_time = current_time;
+          smart_timeline_update = true;
+          if (smart_array[i].state.dusk_day == 0) {
+            smart_array[i].state.dusk_day = now.day();
           }
         }
-        if (smart_array[i].dusk_offset > 0 && smart_array[i].local_dusk_time > -1) {
-          at_dusk_result = verifiedTime(smart_array[i].local_dusk_time + smart_array[i].dusk_offset) == current_time && smart_array[i].lead_u_time + 60 < now.unixtime();
+        if (smart_array[i].dusk_offset > 0 && smart_array[i].state.local_dusk_time > -1) {
+          at_dusk_result = verifiedTime(smart_array[i].state.local_dusk_time + smart_array[i].dusk_offset) == current_time && smart_array[i].state.lead_u_time + 60 < now.unixtime();
         }
         some_activation |= at_dusk_result;
         if (!at_dusk_result && smart_array[i].any_trigger_required) {
           at_dusk_result = smart_array[i].at_dusk == 0 ? sensor_twilight : smart_array[i].at_dusk > light_sensor;
-          if (smart_array[i].dusk_offset > 0 && smart_array[i].local_dusk_time > -1) {
-            at_dusk_result &= (smart_array[i].local_dusk_time + smart_array[i].dusk_offset) < current_time;
+          if (smart_array[i].dusk_offset > 0 && smart_array[i].state.local_dusk_time > -1) {
+            at_dusk_result &= (smart_array[i].state.local_dusk_time + smart_array[i].dusk_offset) < current_time;
           }
         }
         local_result |= at_dusk_result;
       }
 
       if (smart_array[i].at_dawn > -1) {
-        if (smart_array[i].dawn_day > -1 && smart_array[i].dawn_day != now.day() && (smart_array[i].at_dawn == 0 ? sensor_twilight : smart_array[i].at_dawn > light_sensor)) {
-          smart_array[i].dawn_day = 0;
+        if (smart_array[i].state.dawn_day > -1 && smart_array[i].state.dawn_day != now.day() && (smart_array[i].at_dawn == 0 ? sensor_twilight : smart_array[i].at_dawn > light_sensor)) {
+          smart_array[i].state.dawn_day = 0;
         }
         at_dawn_result = trigger == 0 && (smart_array[i].at_dawn == 0 ? (twilight_change ? !sensor_twilight : false) : smart_array[i].at_dawn < light_sensor);
-        at_dawn_result &= smart_array[i].dawn_day == -1 || smart_array[i].dawn_day == 0;
-        at_dawn_result &= !(smart_array[i].has_lowering_at_sunset_offset || calendar_twilight);
-        if (at_dawn_result && (smart_array[i].dawn_day == -1 || smart_array[i].dawn_day == 0)) {
-          smart_array[i].local_dawn_time = current_time;
-          if (smart_array[i].dawn_day == 0) {
-            smart_array[i].dawn_day = now.day();
+        at_dawn_result &= smart_array[i].state.dawn_day == -1 || smart_array[i].state.dawn_day == 0;
+        at_dawn_result &= !(smart_array[i].state.has_lowering_at_sunset_offset || calendar_twilight);
+        if (at_dawn_result && (smart_array[i].state.dawn_day == -1 || smart_array[i].state.dawn_day == 0)) {
+          smart_array[i].state.local_dawn_time = current_time;
+          smart_timeline_update = true;
+          if (smart_array[i].state.dawn_day == 0) {
+            smart_array[i].state.dawn_day = now.day();
           }
         }
-        if (smart_array[i].dawn_offset > 0 && smart_array[i].local_dawn_time > -1) {
-          at_dawn_result &= verifiedTime(smart_array[i].local_dawn_time + smart_array[i].dawn_offset) == current_time && smart_array[i].lead_u_time + 60 < now.unixtime();
+        if (smart_array[i].dawn_offset > 0 && smart_array[i].state.local_dawn_time > -1) {
+          at_dawn_result &= verifiedTime(smart_array[i].state.local_dawn_time + smart_array[i].dawn_offset) == current_time && smart_array[i].state.lead_u_time + 60 < now.unixtime();
         }
         some_activation |= at_dawn_result;
         if (!at_dawn_result && smart_array[i].any_trigger_required) {
           at_dawn_result = smart_array[i].at_dawn == 0 ? !sensor_twilight : smart_array[i].at_dawn < light_sensor;
-          at_dawn_result &= !(smart_array[i].has_lowering_at_sunset_offset || calendar_twilight);
-          if (smart_array[i].dawn_offset > 0 && smart_array[i].local_dawn_time > -1) {
-            at_dawn_result &= (smart_array[i].local_dawn_time + smart_array[i].dawn_offset) < current_time;
+          at_dawn_result &= !(smart_array[i].state.has_lowering_at_sunset_offset || calendar_twilight);
+          if (smart_array[i].dawn_offset > 0 && smart_array[i].state.local_dawn_time > -1) {
+            at_dawn_result &= (smart_array[i].state.local_dawn_time + smart_array[i].dawn_offset) < current_time;
           }
         }
         local_result |= at_dawn_result;
       }
 
-      if (smart_array[i].has_lowering_at_sunset_offset && calendar_twilight) {
-        smart_array[i].has_lowering_at_sunset_offset = false;
+      if (smart_array[i].state.has_lowering_at_sunset_offset && calendar_twilight) {
+        smart_array[i].state.has_lowering_at_sunset_offset = false;
       }
 
       #ifdef light_switch
         if (smart_array[i].at_switch != "?") {
-          at_switch_result = (trigger == 1 && strContains(smart_array[i].at_switch, 1)) || (trigger == 2 && strContains(smart_array[i].at_switch, 2)) || smart_array[i].switch_offset_countdown == 0;
+          at_switch_result = (trigger == 1 && strContains(smart_array[i].at_switch, 1)) || (trigger == 2 && strContains(smart_array[i].at_switch, 2)) || smart_array[i].state.switch_offset_countdown == 0;
           if (strContains(smart_array[i].at_switch, 1)) {
             if (strContains(smart_array[i].at_switch, -1)) {
               at_switch_result &= !light[0];
@@ -1102,13 +2093,13 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
               at_switch_result &= light[1];
             }
           }
-          if (at_switch_result && smart_array[i].switch_offset > 0 && smart_array[i].switch_offset_countdown == -1) {
+          if (at_switch_result && smart_array[i].switch_offset > 0 && smart_array[i].state.switch_offset_countdown == -1) {
             at_switch_result = false;
-            smart_array[i].switch_offset_countdown = smart_array[i].switch_offset * 60;
+            smart_array[i].state.switch_offset_countdown = smart_array[i].switch_offset * 60;
           }
           some_activation |= at_switch_result;
-          if (smart_array[i].switch_offset_countdown > -1) {
-            smart_array[i].switch_offset_countdown--;
+          if (smart_array[i].state.switch_offset_countdown > -1) {
+            smart_array[i].state.switch_offset_countdown--;
           }
           local_result |= at_switch_result;
         }
@@ -1132,82 +2123,39 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       #endif
 
       #ifdef blinds
-        if (smart_array[i].at_blinds != "?") {
-          at_blinds_result = trigger == 5 || smart_array[i].blinds_offset_countdown == 0;
-          if (strContains(smart_array[i].at_blinds, ";")) {
-            at_blinds_result &= getActual(true) == smart_array[i].at_blinds;
-          } else {
-            at_blinds_result &= getActual(true) == (steps[0] > 0 ? smart_array[i].at_blinds : "0") + ";" + (steps[1] > 0 ? smart_array[i].at_blinds : "0") + ";" + (steps[2] > 0 ? smart_array[i].at_blinds : "0");
+        if (smart_array[i].at_blinds[0] > -1) {
+          at_blinds_result = trigger == 5 || smart_array[i].state.blinds_offset_countdown == 0;
+          for (int j = 0; j < 3; j++) {
+            at_blinds_result &= steps[j] == 0 || getActual(j) == smart_array[i].at_blinds[j];
           }
-          if (at_blinds_result && smart_array[i].blinds_offset > 0 && smart_array[i].blinds_offset_countdown == -1) {
+          if (at_blinds_result && smart_array[i].blinds_offset > 0 && smart_array[i].state.blinds_offset_countdown == -1) {
             at_blinds_result = false;
-            smart_array[i].blinds_offset_countdown = smart_array[i].blinds_offset * 60;
+            smart_array[i].state.blinds_offset_countdown = smart_array[i].blinds_offset * 60;
           }
           some_activation |= at_blinds_result;
-          if (smart_array[i].blinds_offset_countdown > -1) {
-            smart_array[i].blinds_offset_countdown--;
+          if (smart_array[i].state.blinds_offset_countdown > -1) {
+            smart_array[i].state.blinds_offset_countdown--;
           }
           local_result |= at_blinds_result;
         }
 
-        if (smart_array[i].must_be_ != "?") {
-          if (strContains(smart_array[i].must_be_, "<") || strContains(smart_array[i].must_be_, ">")) {
-            if (strContains(smart_array[i].must_be_, ";")) {
-              if (strContains(smart_array[i].must_be_.substring(0, smart_array[i].must_be_.indexOf(";")), "<")) {
-                local_result &= destination[0] <= actual[0];
-                local_result &= getValue(0) < smart_array[i].must_be_.substring(1, smart_array[i].must_be_.indexOf(";")).toInt();
-              } else {
-                if (strContains(smart_array[i].must_be_.substring(0, smart_array[i].must_be_.indexOf(";")), ">")) {
-                  local_result &= destination[0] >= actual[0];
-                  local_result &= getValue(0) > smart_array[i].must_be_.substring(1, smart_array[i].must_be_.indexOf(";")).toInt();
-                } else {
-                  local_result &= destination[0] == actual[0];
-                  local_result &= getValue(0) == smart_array[i].must_be_.substring(0, smart_array[i].must_be_.indexOf(";")).toInt();
-                }
-              }
-              if (strContains(smart_array[i].must_be_.substring(smart_array[i].must_be_.indexOf(";") + 1, smart_array[i].must_be_.lastIndexOf(";")), "<")) {
-                local_result &= destination[1] <= actual[1];
-                local_result &= getValue(1) < smart_array[i].must_be_.substring(smart_array[i].must_be_.indexOf(";") + 2, smart_array[i].at_blinds.lastIndexOf(";")).toInt();
-              } else {
-                if (strContains(smart_array[i].must_be_.substring(smart_array[i].must_be_.indexOf(";") + 1, smart_array[i].must_be_.lastIndexOf(";")), ">")) {
-                  local_result &= destination[1] >= actual[1];
-                  local_result &= getValue(1) > smart_array[i].must_be_.substring(smart_array[i].must_be_.indexOf(";") + 2, smart_array[i].at_blinds.lastIndexOf(";")).toInt();
-                } else {
-                  local_result &= destination[1] == actual[1];
-                  local_result &= getValue(1) == smart_array[i].must_be_.substring(smart_array[i].must_be_.indexOf(";") + 1, smart_array[i].at_blinds.lastIndexOf(";")).toInt();
-                }
-              }
-              if (strContains(smart_array[i].must_be_.substring(smart_array[i].must_be_.lastIndexOf(";")), "<")) {
-                local_result &= destination[2] <= actual[2];
-                local_result &= getValue(2) < smart_array[i].must_be_.substring(smart_array[i].must_be_.lastIndexOf(";") + 2).toInt();
-              } else {
-                if (strContains(smart_array[i].must_be_.substring(smart_array[i].must_be_.lastIndexOf(";")), ">")) {
-                  local_result &= destination[2] >= actual[2];
-                  local_result &= getValue(2) > smart_array[i].must_be_.substring(smart_array[i].must_be_.lastIndexOf(";") + 2).toInt();
-                } else {
-                  local_result &= destination[2] == actual[2];
-                  local_result &= getValue(2) == smart_array[i].must_be_.substring(smart_array[i].must_be_.lastIndexOf(";") + 1).toInt();
-                }
-              }
-            } else {
-              if (strContains(smart_array[i].must_be_, "<")) {
-                for (int j = 0; j < 3; j++) {
-                  local_result &= steps[j] == 0 || (destination[j] <= actual[j] && getValue(j) < smart_array[i].must_be_.substring(1).toInt());
-                }
-              } else {
-                for (int j = 0; j < 3; j++) {
-                  local_result &= steps[j] == 0 || (destination[j] >= actual[j] && getValue(j) > smart_array[i].must_be_.substring(1).toInt());
-                }
-              }
+        if (smart_array[i].sun_facade > -1) {
+          at_sun_result = sun_azimuth > -1 && sun_elevation >= smart_array[i].sun_height * 10
+            && abs((sun_azimuth - smart_array[i].sun_facade * 10 + 5400) % 3600 - 1800) <= smart_array[i].sun_range * 10;
+          some_activation |= at_sun_result;
+          local_result |= at_sun_result;
+        }
+
+        for (int j = 0; j < 3; j++) {
+          if (steps[j] > 0) {
+            if (smart_array[i].must_be_[j] == smart_condition_equal) {
+              local_result &= destination[j] == actual[j] && getValue(j) == smart_array[i].must_be_value[j];
             }
-          } else {
-            local_result &= destination[0] == actual[0] && destination[1] == actual[1] && destination[2] == actual[2];
-            if (strContains(smart_array[i].must_be_, ";")) {
-              local_result &= getValue() == smart_array[i].must_be_;
-            } else {
-              for (int j = 0; j < 3; j++) {
-                local_result &= steps[j] == 0 || getValue(j) == smart_array[i].must_be_.toInt();
-              }
+            if (smart_array[i].must_be_[j] == smart_condition_below) {
+              local_result &= destination[j] <= actual[j] && getValue(j) < smart_array[i].must_be_value[j];
+            }
+            if (smart_array[i].must_be_[j] == smart_condition_above) {
+              local_result &= destination[j] >= actual[j] && getValue(j) > smart_array[i].must_be_value[j];
             }
           }
         }
@@ -1215,15 +2163,15 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
 
       #ifdef thermostat
         if (smart_array[i].at_thermostat != "?") {
-          at_thermostat_result = trigger == 6 || smart_array[i].thermostat_offset_countdown == 0;
+          at_thermostat_result = trigger == 6 || smart_array[i].state.thermostat_offset_countdown == 0;
           at_thermostat_result &= temperature == smart_array[i].at_thermostat.toFloat();
-          if (at_thermostat_result && smart_array[i].thermostat_offset > 0 && smart_array[i].thermostat_offset_countdown == -1) {
+          if (at_thermostat_result && smart_array[i].thermostat_offset > 0 && smart_array[i].state.thermostat_offset_countdown == -1) {
             at_thermostat_result = false;
-            smart_array[i].thermostat_offset_countdown = smart_array[i].thermostat_offset * 60;
+            smart_array[i].state.thermostat_offset_countdown = smart_array[i].thermostat_offset * 60;
           }
           some_activation |= at_thermostat_result;
-          if (smart_array[i].thermostat_offset_countdown > -1) {
-            smart_array[i].thermostat_offset_countdown--;
+          if (smart_array[i].state.thermostat_offset_countdown > -1) {
+            smart_array[i].state.thermostat_offset_countdown--;
           }
           local_result |= at_thermostat_result;
         }
@@ -1247,15 +2195,15 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
 
       #ifdef chain
         if (smart_array[i].at_chain != "?") {
-          at_chain_result = trigger == 5 || smart_array[i].chain_offset_countdown == 0;
+          at_chain_result = trigger == 5 || smart_array[i].state.chain_offset_countdown == 0;
           at_chain_result &= getActual() == smart_array[i].at_chain;
-          if (at_chain_result && smart_array[i].chain_offset > 0 && smart_array[i].chain_offset_countdown == -1) {
+          if (at_chain_result && smart_array[i].chain_offset > 0 && smart_array[i].state.chain_offset_countdown == -1) {
             at_chain_result = false;
-            smart_array[i].chain_offset_countdown = smart_array[i].chain_offset * 60;
+            smart_array[i].state.chain_offset_countdown = smart_array[i].chain_offset * 60;
           }
           some_activation |= at_chain_result;
-          if (smart_array[i].chain_offset_countdown > -1) {
-            smart_array[i].chain_offset_countdown--;
+          if (smart_array[i].state.chain_offset_countdown > -1) {
+            smart_array[i].state.chain_offset_countdown--;
           }
           local_result |= at_chain_result;
         }
@@ -1274,19 +2222,19 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         }
       #endif
 
-      if (smart_array[i].twilight_must_be_ != "?") {
+      if (smart_array[i].twilight_must_be_ != 0) {
         if (next_sunset > -1 && next_sunrise > -1) {
-          if (strContains(smart_array[i].twilight_must_be_, "n")) {
+          if (smart_array[i].twilight_must_be_ & twilight_sunset) {
             local_result &= calendar_twilight;
           }
-          if (strContains(smart_array[i].twilight_must_be_, "d")) {
+          if (smart_array[i].twilight_must_be_ & twilight_sunrise) {
             local_result &= !calendar_twilight;
           }
         }
-        if (strContains(smart_array[i].twilight_must_be_, "<")) {
+        if (smart_array[i].twilight_must_be_ & twilight_dusk) {
           local_result &= sensor_twilight;
         }
-        if (strContains(smart_array[i].twilight_must_be_, ">")) {
+        if (smart_array[i].twilight_must_be_ & twilight_dawn) {
           local_result &= !sensor_twilight;
         }
       }
@@ -1306,7 +2254,8 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_switch == "?" || (smart_array[i].at_switch != "?" && at_switch_result));
       #endif
       #ifdef blinds
-        local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_blinds == "?" || (smart_array[i].at_blinds != "?" && at_blinds_result));
+        local_result &= !smart_array[i].any_trigger_required || smart_array[i].at_blinds[0] == -1 || at_blinds_result;
+        local_result &= !smart_array[i].any_trigger_required || smart_array[i].sun_facade == -1 || at_sun_result;
       #endif
       #ifdef thermostat
         local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_thermostat == "?" || (smart_array[i].at_thermostat != "?" && at_thermostat_result));
@@ -1317,7 +2266,11 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
 
       if (local_result) {
         if (at_sunset_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          #ifdef blinds
+            action = getSmartAction(smart_array[i].action, 100);
+          #else
+            action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          #endif
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1330,7 +2283,11 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_sunrise_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "0" : smart_array[i].action;
+          #ifdef blinds
+            action = getSmartAction(smart_array[i].action, 0);
+          #else
+            action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "0" : smart_array[i].action;
+          #endif
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1343,7 +2300,11 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_dusk_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          #ifdef blinds
+            action = getSmartAction(smart_array[i].action, 100);
+          #else
+            action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          #endif
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1353,7 +2314,11 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_dawn_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "0" : smart_array[i].action;
+          #ifdef blinds
+            action = getSmartAction(smart_array[i].action, 0);
+          #else
+            action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "0" : smart_array[i].action;
+          #endif
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1363,7 +2328,11 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_time_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          #ifdef blinds
+            action = getSmartAction(smart_array[i].action, 100);
+          #else
+            action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          #endif
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1392,7 +2361,18 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
             if (smart_array[i].blinds_offset > 0) {
               local_log += "+" + String(smart_array[i].blinds_offset);
             }
-            local_log += " " + smart_array[i].at_blinds;
+            local_log += " " + getActual(true);
+          }
+          if (at_sun_result) { // The more directly the sun hits the window, the closer to the action value, in steps of 10%.
+            action = getSmartAction(smart_array[i].action, 100);
+            int incidence = (int32_t)cosinus(sun_elevation) * cosinus(sun_azimuth - smart_array[i].sun_facade * 10) >> 14;
+            for (int j = 0; j < 3; j++) {
+              action.value[j] = ((int32_t)action.value[j] * incidence / 16384 + 5) / 10 * 10;
+            }
+            if (local_log.length() > 2) {
+              local_log += " & ";
+            }
+            local_log += "sun " + String(sun_azimuth / 10) + "/" + String(sun_elevation / 10);
           }
         #endif
         #ifdef thermostat
@@ -1434,22 +2414,42 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
             action = smart_array[i].action;
           }
         }
-        if (smart_array[i].must_be_ != "?") {
-          local_log += ", must_be_";
-          local_log += smart_array[i].must_be_;
-        }
+        #ifdef blinds
+          if (hasSmartCondition(i)) {
+            local_log += ", must_be_";
+            local_log += getSmartParameter(smart_array[i].smart_string, "r(");
+          }
+        #else
+          if (hasSmartCondition(i)) {
+            local_log += ", must_be_";
+            local_log += smart_array[i].must_be_;
+          }
+        #endif
         if (trigger > -1) {
           local_log += " (trigger: " + String(trigger) + ")";
         }
 
-        if (action != "?") {
+        #ifdef blinds
+          bool has_action = action.type != smart_action_none;
+          bool remote_action = action.type == smart_action_remote;
+        #else
+          bool has_action = action != "?";
+          bool remote_action = strContains(action, ".") && strContains(action, ";") && action.indexOf(".") < action.indexOf(";");
+        #endif
+
+        if (has_action) {
           local_log = (smart_array[i].any_trigger_required ? " after " : " at ") + local_log;
-          if (strContains(action, ".") && strContains(action, ";") && action.indexOf(".") < action.indexOf(";")) {
-            putOfflineData(action.substring(0, action.indexOf(";")), "{\"val\":\"" + action.substring(action.indexOf(";") + 1) + "\"}");
-            log_text = "Action " + action + local_log;
+          if (remote_action) {
+            #ifdef blinds
+              String remote_action_string = getSmartAction(smart_array[i].smart_string);
+            #else
+              String remote_action_string = action;
+            #endif
+            putOfflineData(remote_action_string.substring(0, remote_action_string.indexOf(";")), "{\"val\":\"" + remote_action_string.substring(remote_action_string.indexOf(";") + 1) + "\"}");
+            log_text = "Action " + remote_action_string + local_log;
           } else {
             #ifdef light_switch
-              if (strContains(smart_array[i].what, 1) || smart_array[i].what == "?") {
+              if ((smart_array[i].what & 1) || smart_array[i].what == 0) {
                 if (strContains(action, -1) || action == "0") {
                   new_light[0] = 0;
                 } else {
@@ -1458,7 +2458,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                   }
                 }
               }
-              if (strContains(smart_array[i].what, 2) || smart_array[i].what == "?") {
+              if ((smart_array[i].what & 2) || smart_array[i].what == 0) {
                 if (strContains(action, -2) || action == "0") {
                   new_light[1] = 0;
                 } else {
@@ -1469,69 +2469,43 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
               }
               if (((new_light[0] > -1 && (light[0] ? 1 : 0) != new_light[0])
               || (new_light[1] > -1 && (light[1] ? 1 : 0) != new_light[1])) && !smart_lock) {
-                if (smart_array[i].what != "?") {
-                  log_text = smart_array[i].what + " to ";
+                if (smart_array[i].what != 0) {
+                  log_text = getSmartWhat(smart_array[i].what) + " to ";
                 }
                 log_text += (smart_array[i].action != "?" ? action : (strContains(action, 1) ? "On" : "Off")) + local_log;
                 result |= true;
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
-                }
+                smart_array[i].state.lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
               }
             #endif
             #ifdef blinds
-              if (strContains(action, ";")) {
-                new_destination[0] = toSteps(action.substring(0, action.indexOf(";")).toInt(), steps[0]);
-                new_destination[1] = toSteps(action.substring(action.indexOf(";") + 1, action.lastIndexOf(";")).toInt(), steps[1]);
-                new_destination[2] = toSteps(action.substring(action.lastIndexOf(";") + 1).toInt(), steps[2]);
-              } else {
-                if ((strContains(smart_array[i].what, 1) || smart_array[i].what == "?") && steps[0] > 0) {
-                    new_destination[0] = toSteps(action.toInt(), steps[0]);
-                }
-                if ((strContains(smart_array[i].what, 2) || smart_array[i].what == "?") && steps[1] > 0) {
-                  new_destination[1] = toSteps(action.toInt(), steps[1]);
-                }
-                if ((strContains(smart_array[i].what, 3) || smart_array[i].what == "?") && steps[2] > 0) {
-                  new_destination[2] = toSteps(action.toInt(), steps[2]);
+              for (int j = 0; j < 3; j++) {
+                if ((action.type == smart_action_wings || smart_array[i].what == 0 || (smart_array[i].what & (1 << j))) && steps[j] > 0) {
+                  new_destination[j] = toSteps(action.value[j], steps[j]);
                 }
               }
               if (((new_destination[0] > -1 && destination[0] != new_destination[0])
               || (new_destination[1] > -1 && destination[1] != new_destination[1])
               || (new_destination[2] > -1 && destination[2] != new_destination[2])) && !smart_lock) {
-                if (smart_array[i].action != "?") {
-                  if (strContains(action, ";")) {
-                    log_text = action + local_log;
+                if (smart_array[i].action.type != smart_action_none) {
+                  if (action.type == smart_action_wings) {
+                    log_text = getSmartValue(action) + local_log;
                   } else {
-                    if (smart_array[i].what != "?") {
-                      log_text = smart_array[i].what + " ";
+                    if (smart_array[i].what != 0) {
+                      log_text = getSmartWhat(smart_array[i].what) + " ";
                     }
-                    log_text += action + "%" + local_log;
+                    log_text += getSmartValue(action) + "%" + local_log;
                   }
                 } else {
-                  if (smart_array[i].what != "?") {
-                    log_text = smart_array[i].what + " ";
+                  if (smart_array[i].what != 0) {
+                    log_text = getSmartWhat(smart_array[i].what) + " ";
                   }
-                  log_text += (action == "100" ? "Lowering" : "Lifting") + local_log;
+                  log_text += (action.value[0] == 100 ? "Lowering" : "Lifting") + local_log;
                 }
                 result |= true;
                 if (at_sunset_result && !calendar_twilight) {
-                  smart_array[i].has_lowering_at_sunset_offset = true;
-                }
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
+                  smart_array[i].state.has_lowering_at_sunset_offset = true;
                 }
+                smart_array[i].state.lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
               }
             #endif
             #ifdef thermostat
@@ -1546,15 +2520,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                 log_text = (strContains(action, ".") ? ("Up to " + action + "°C") : String("Heating ") + (strContains(action, "1") ? "on" : "off")) + local_log;
                 result |= true;
                 smart_heating = i;
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
-                }
+                smart_array[i].state.lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
               }
             #endif
             #ifdef chain
@@ -1567,17 +2533,9 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                 }
                 result |= true;
                 if (at_sunset_result && !calendar_twilight) {
-                  smart_array[i].has_lowering_at_sunset_offset = true;
-                }
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
+                  smart_array[i].state.has_lowering_at_sunset_offset = true;
                 }
+                smart_array[i].state.lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
               }
             #endif
           }
@@ -1598,21 +2556,16 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         }
         note(log_text);
         setLights("smart");
-        writeObjectToFile("smart", getSmartJson(true));
+        saveSmartState();
       }
     #endif
     #ifdef blinds
       if ((new_destination[0] > -1 && destination[0] != new_destination[0])
       || (new_destination[1] > -1 && destination[1] != new_destination[1])
       || (new_destination[2] > -1 && destination[2] != new_destination[2])) {
-        for (int j = 0; j < 3; j++) {
-          if (new_destination[j] > -1 && steps[j] > 0) {
-            destination[j] = new_destination[j];
-          }
-        }
         note(log_text);
-        prepareRotation("smart");
-        writeObjectToFile("smart", getSmartJson(true));
+        queueMotion(new_destination, "smart");
+        saveSmartState();
       }
     #endif
     #ifdef thermostat
@@ -1626,7 +2579,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
           note(log_text);
           setHeating(heating, "smart");
-          writeObjectToFile("smart", getSmartJson(true));
+          saveSmartState();
         }
       }
       if (!heating) {
@@ -1640,7 +2593,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         }
         note(log_text);
         prepareRotation("smart");
-        writeObjectToFile("smart", getSmartJson(true));
+        saveSmartState();
       }
     #endif
   }
@@ -1652,97 +2605,240 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       setHeating(heating, "minimum");
     }
   #endif
-}
-
-
-void connectingToWifi(bool use_wps) {
-  if (ssid.length() == 0 && password.length() == 0) {
-    initiatingWPS();
-    return;
-  }
 
-  String log_text = "Connecting to Wi-Fi";
-  Serial.print("\n" + log_text);
+  profile(profile_smart, start_us);
+}
 
 
-  WiFi.mode(WIFI_STA);
+void setWiFiState(uint8_t state) {
+  wifi_state = state;
+  wifi_state_millis = millis();
+}
 
-  if (ssid.length() > 0 && password.length() > 0) {
-    WiFi.begin(ssid.c_str(), password.c_str());
-  } else {
-    WiFi.begin();
-  }
+void connectingToWifi() { // Polled from the loop, every state does a short step and returns.
+  if (wifi_state == wifi_off) {
+    if (ssid.length() == 0 && password.length() == 0) {
+      initiatingWPS();
+      return;
+    }
 
-  int timeout = 0;
-  while (timeout++ < 10 && WiFi.status() != WL_CONNECTED) {
-    delay(250);
-    Serial.print(".");
-    delay(250);
+    Serial.print("\nConnecting to Wi-Fi");
+    WiFi.mode(WIFI_STA);
+    if (ssid.length() > 0 && password.length() > 0) {
+      WiFi.begin(ssid.c_str(), password.c_str());
+    } else {
+      WiFi.begin();
+    }
+    setWiFiState(wifi_connecting);
+    return;
   }
 
-  bool result = WiFi.status() == WL_CONNECTED;
+  if (wifi_state == wifi_connecting) {
+    if (WiFi.status() == WL_CONNECTED) {
+      String log_text = "Connected to " + WiFi.SSID();
+      log_text += " : " + WiFi.localIP().toString();
+      if (password.length() == 0) {
+        password = WiFi.psk();
+        saveSettings(false);
+      }
+      note(log_text);
+      setWiFiState(wifi_connected);
+    } else {
+      if (millis() - wifi_state_millis > wifi_timeout) {
+        note("Connecting to Wi-Fi timed out");
+        initiatingWPS();
+      }
+    }
+    return;
+  }
+
+  if (wifi_state == wifi_wps) {
+    if (WiFi.status() != WL_CONNECTED && millis() - wifi_state_millis < wifi_timeout) {
+      return;
+    }
 
-  if (result) {
-    log_text = "Connected to " + WiFi.SSID();
-    log_text += " : " + WiFi.localIP().toString();
-    if (password.length() == 0) {
+    String log_text = "Initiating WPS";
+    bool result = WiFi.beginWPSConfig(); // The only blocking step, it waits for the WPS exchange.
+    result &= String(WiFi.SSID()).length() > 0;
+
+    if (result) {
+      ssid = WiFi.SSID();
       password = WiFi.psk();
-        saveSettings(false);
+
+      log_text += " finished. ";
+      log_text += "Connected to " + WiFi.SSID();
+      log_text += " : " + WiFi.localIP().toString();
+      saveSettings();
+      setWiFiState(wifi_connected);
+    } else {
+      log_text += " timed out";
+      setWiFiState(wifi_off);
     }
-  } else {
-    log_text += " timed out";
+    note(log_text);
+    return;
   }
-  note(log_text);
 
-  if (result) {
+  if (wifi_state == wifi_connected) {
     startServices();
     WiFi.setAutoReconnect(true);
     auto_reconnect = true;
-  } else {
-    if (use_wps) {
-      initiatingWPS();
+    wifiUdp.begin(ntp_local_port);
+    requestTime();
+    setWiFiState(wifi_time);
+    return;
+  }
+
+  if (wifi_state == wifi_time) {
+    if (!receiveTime() && ntp_millis > 0) {
+      return;
+    }
+    wifi_peer = 0;
+    wifi_peers_count = getDevices();
+    setWiFiState(wifi_peers);
+    return;
+  }
+
+  if (wifi_state == wifi_peers) {
+    if (wifi_peer < wifi_peers_count && wifi_peer < devices_count) {
+      getOfflineData(wifi_peer++);
+    } else {
+      note("Ready in " + String(millis() / 1000) + "s");
+      setWiFiState(wifi_ready);
     }
   }
 }
 
-void initiatingWPS() {
-  String log_text = "Initiating WPS";
-  Serial.print("\n" + log_text);
+void requestTime() { // Sends an NTP request, receiveTime() picks up the reply in a later pass.
+  if (!ntp_address.isSet() && !WiFi.hostByName(ntp_server, ntp_address)) { // The lookup waits for DNS, so it is done once.
+    return;
+  }
 
+  uint8_t packet[48] = {0};
+  packet[0] = 0x1B; // Version 3, client.
+  while (wifiUdp.parsePacket() > 0) { // Drops late replies to an earlier request.
+    yield();
+  }
+  wifiUdp.beginPacket(ntp_address, ntp_port);
+  wifiUdp.write(packet, sizeof(packet));
+  wifiUdp.endPacket();
+  ntp_millis = max(millis(), 1UL);
+}
 
-  WiFi.mode(WIFI_STA);
+bool receiveTime() {
+  if (ntp_millis == 0) {
+    return false;
+  }
+
+  if (wifiUdp.parsePacket() < 48) {
+    if (millis() - ntp_millis > ntp_timeout) {
+      ntp_millis = 0;
+      note("NTP timed out");
+    }
+    return false;
+  }
+
+  uint8_t packet[48];
+  wifiUdp.read(packet, sizeof(packet));
+  ntp_millis = 0;
+  uint32_t seconds = (uint32_t)packet[40] << 24 | (uint32_t)packet[41] << 16 | (uint32_t)packet[42] << 8 | packet[43];
+  readData("{\"time\":" + String(seconds - 2208988800UL) + "}", false); // NTP counts from 1900.
+  return true;
+}
 
+void initiatingWPS() {
+  Serial.print("\nInitiating WPS");
+  WiFi.mode(WIFI_STA);
   WiFi.begin("idom", "");
-  int timeout = 0;
-  while (timeout++ < 10 && WiFi.status() != WL_CONNECTED) {
-    delay(250);
-    Serial.print(".");
-    delay(250);
+  setWiFiState(wifi_wps);
+}
+
+
+void readTheLog() {
+  if (LittleFS.exists("/log.txt")) {
+    LittleFS.rename("/log.txt", getLogSegment(0));
+    log_index.head = 0;
+    for (int i = 0; i < log_segments; i++) {
+      log_index.first[i] = 0;
+    }
+    saveTheLogIndex();
+  }
+
+  File file = LittleFS.open("/log.idx", "r");
+  if (!file) {
+    keep_log = false;
+    return;
+  }
+  keep_log = file.read((uint8_t*)&log_index, sizeof(log_index)) == sizeof(log_index) && log_index.head < log_segments;
+  file.close();
+  if (!keep_log) {
+    return;
   }
 
-  bool result = WiFi.beginWPSConfig();
-  result &= String(WiFi.SSID()).length() > 0;
+  log_records = log_index.first[log_index.head];
+  file = LittleFS.open(getLogSegment(log_index.head), "r");
+  if (file) {
+    uint8_t buffer[128];
+    int length;
+    while ((length = file.read(buffer, sizeof(buffer))) > 0) {
+      for (int i = 0; i < length; i++) {
+        if (buffer[i] == '\n') {
+          log_records++;
+        }
+      }
+    }
+    file.close();
+  }
+}
 
-  if (result) {
-    ssid = WiFi.SSID();
-    password = WiFi.psk();
+void flushTheLog(bool force) {
+  if (log_buffer.length() == 0 || !(force || millis() - log_buffer_millis >= log_window)) {
+    return;
+  }
 
-    log_text += " finished. ";
-    log_text += "Connected to " + WiFi.SSID();
-    log_text += " : " + WiFi.localIP().toString();
-  } else {
-    log_text += " timed out";
+  File file = LittleFS.open(getLogSegment(log_index.head), "a");
+  if (file && file.size() > 0 && file.size() + log_buffer.length() > log_segment_size) {
+    file.close();
+    log_index.head = (log_index.head + 1) % log_segments;
+    log_index.first[log_index.head] = log_records;
+    saveTheLogIndex();
+    file = LittleFS.open(getLogSegment(log_index.head), "w");
+  }
+  if (file) {
+    file.print(log_buffer);
+    file.close();
   }
-  note(log_text);
 
-  if (result) {
-    saveSettings();
-    startServices();
-    WiFi.setAutoReconnect(true);
-    auto_reconnect = true;
+  for (unsigned int i = 0; i < log_buffer.length(); i++) {
+    if (log_buffer.charAt(i) == '\n') {
+      log_records++;
+    }
+  }
+  log_buffer = "";
+}
+
+void saveTheLogIndex() {
+  File file = LittleFS.open("/log.idx", "w");
+  if (file) {
+    file.write((uint8_t*)&log_index, sizeof(log_index));
+    file.close();
+  }
+}
+
+void removeTheLog() {
+  for (int i = 0; i < log_segments; i++) {
+    if (LittleFS.exists(getLogSegment(i))) {
+      LittleFS.remove(getLogSegment(i));
+    }
+    log_index.first[i] = 0;
   }
+  log_index.head = 0;
+  log_records = 0;
+  log_buffer = "";
 }
 
+String getLogSegment(int segment) {
+  return "/log" + String(segment) + ".txt";
+}
 
 void activationTheLog() {
   if (keep_log) {
@@ -1750,11 +2846,8 @@ void activationTheLog() {
     return;
   }
 
-  File file = LittleFS.open("/log.txt", "a");
-  if (file) {
-    file.println();
-    file.close();
-  }
+  removeTheLog();
+  saveTheLogIndex();
   last_accessed_log = 0;
   saveSettings(false);
   keep_log = true;
@@ -1768,8 +2861,9 @@ void deactivationTheLog() {
     return;
   }
 
-  if (LittleFS.exists("/log.txt")) {
-    LittleFS.remove("/log.txt");
+  removeTheLog();
+  if (LittleFS.exists("/log.idx")) {
+    LittleFS.remove("/log.idx");
   }
   last_accessed_log = 0;
   saveSettings(false);
@@ -1779,48 +2873,107 @@ void deactivationTheLog() {
 }
 
 void requestForLogs() {
-  File file = LittleFS.open("/log.txt", "r");
-  if (!file) {
+  if (!keep_log) {
     server.send(404, "text/plain", "No log file");
     return;
   }
+  flushTheLog(true);
 
-  server.setContentLength(file.size() + String("Log file\nHTTP/1.1 200 OK").length());
-  server.send(200, "text/plain", "Log file\n");
-  while (file.available()) {
-    server.sendContent(String(char(file.read())));
+  uint32_t oldest = log_records;
+  for (int i = 1; i <= log_segments; i++) {
+    if (LittleFS.exists(getLogSegment((log_index.head + i) % log_segments))) {
+      oldest = log_index.first[(log_index.head + i) % log_segments];
+      break;
+    }
   }
-  file.close();
+  uint32_t from = server.hasArg("from") ? constrain((uint32_t)server.arg("from").toInt(), oldest, log_records) : oldest;
+  uint32_t end = server.hasArg("limit") && server.arg("limit").toInt() > 0 ? min(from + (uint32_t)server.arg("limit").toInt(), log_records) : log_records;
+
+  server.sendHeader("X-Log-Next", String(end));
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", server.hasArg("from") ? "" : "Log file\n");
+
+  uint8_t buffer[512];
+  int length;
+  int segment;
+  uint32_t record;
+  for (int i = 1; i <= log_segments && from < end; i++) {
+    segment = (log_index.head + i) % log_segments;
+    record = log_index.first[segment];
+    if ((segment == log_index.head ? log_records : log_index.first[(segment + 1) % log_segments]) <= from) {
+      continue;
+    }
+
+    File file = LittleFS.open(getLogSegment(segment), "r");
+    if (!file) {
+      continue;
+    }
+    while (record < end && (length = file.read(buffer, sizeof(buffer))) > 0) {
+      int begin = -1;
+      int stop = length;
+      for (int k = 0; k < length; k++) {
+        if (begin < 0 && record >= from) {
+          begin = k;
+        }
+        if (buffer[k] == '\n' && ++record >= end) {
+          stop = k + 1;
+          break;
+        }
+      }
+      if (begin >= 0) {
+        server.sendContent((const char*)buffer + begin, stop - begin);
+      }
+    }
+    file.close();
+  }
+  server.sendContent("");
 
   last_accessed_log = 0;
   saveSettings(false);
-
-  server.send(200, "text/plain", "Done");
 }
 
 void clearTheLog() {
-  File file = LittleFS.open("/log.txt", "w");
-  if (!file) {
+  if (!keep_log) {
     server.send(404, "text/plain", "Failed!");
     return;
   }
 
-  file.println();
-  file.close();
+  removeTheLog();
+  saveTheLogIndex();
 
   server.send(200, "text/plain", "The log file was cleared");
 }
 
 
+void setLocation() {
+  if (geo_location.length() > 2) {
+    sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
+  } else {
+    last_sun_check = -1;
+    next_sunset = -1;
+    next_sunrise = -1;
+    sunset_u_time = 0;
+    sunrise_u_time = 0;
+    calendar_twilight = false;
+  }
+}
+
 void getSunriseSunset(DateTime now) {
   if (geo_location.length() < 2) {
     return;
   }
 
-  sun.setCurrentDate(now.year(), now.month(), now.day());
+  int sunrise;
+  int sunset;
+  if (!getSunTable(now.month(), now.day(), sunrise, sunset)) {
+    sun.setCurrentDate(now.year(), now.month(), now.day());
+    sunrise = sun.calcSunrise();
+    sunset = sun.calcSunset();
+  }
 
-  next_sunset = sun.calcSunset() + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
-  next_sunrise = sun.calcSunrise() + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
+  state_generation++;
+  next_sunset = sunset + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
+  next_sunrise = sunrise + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
   last_sun_check = now.day();
   note("Sunrise: " + String(next_sunrise) + " / Sunset: " + String(next_sunset));
   if (calendar_twilight != !(next_sunrise < (now.hour() * 60) + now.minute() && (now.hour() * 60) + now.minute() < next_sunset)) {
@@ -1829,32 +2982,327 @@ void getSunriseSunset(DateTime now) {
   }
 }
 
+bool buildSunTable() { // UTC minutes of the sunrise and sunset for every day of the year at geo_location.
+  File file = LittleFS.open("/sun.bin", "w");
+  if (!file) {
+    return false;
+  }
+
+  uint32_t location = crc32(geo_location.c_str(), geo_location.length()); // Any length of location fits the header.
+  file.write((uint8_t*)&location, sizeof(location));
+
+  int16_t times[2];
+  for (int month = 1; month <= 12; month++) {
+    for (int day = 1; day <= (month == 12 ? sun_days : days_before_month[month]) - days_before_month[month - 1]; day++) {
+      sun.setCurrentDate(2024, month, day);
+      times[0] = sun.calcSunrise();
+      times[1] = sun.calcSunset();
+      file.write((uint8_t*)times, sizeof(times));
+      yield();
+    }
+  }
+  file.close();
+
+  sun_table_location = geo_location;
+  note("Sun table for " + geo_location);
+  return true;
+}
+
+bool getSunTable(int month, int day, int& sunrise, int& sunset) {
+  int index = month >= 1 && month <= 12 && day >= 1 ? days_before_month[month - 1] + day - 1 : -1;
+  if (index < 0 || index >= sun_days) {
+    return false;
+  }
+
+  if (sun_table_location != geo_location) {
+    uint32_t location = 0;
+    File file = LittleFS.open("/sun.bin", "r");
+    if (file) {
+      file.read((uint8_t*)&location, sizeof(location));
+      file.close();
+    }
+    if (location == crc32(geo_location.c_str(), geo_location.length())) {
+      sun_table_location = geo_location;
+    } else if (!buildSunTable()) {
+      return false;
+    }
+  }
+
+  File file = LittleFS.open("/sun.bin", "r");
+  int16_t times[2];
+  if (!file || !file.seek(sizeof(uint32_t) + index * sizeof(times)) || file.read((uint8_t*)times, sizeof(times)) != sizeof(times)) {
+    if (file) {
+      file.close();
+    }
+    return false;
+  }
+  file.close();
+
+  sunrise = times[0];
+  sunset = times[1];
+  return true;
+}
+
+int sinus(int angle) { // Tenths of a degree to sine * 16384.
+  angle %= 3600;
+  if (angle < 0) {
+    angle += 3600;
+  }
+  int sign = angle < 1800 ? 1 : -1;
+  angle %= 1800;
+  if (angle > 900) {
+    angle = 1800 - angle;
+  }
+  int degree = angle / 10;
+  int value = degree == 90 ? sine_table[90] : sine_table[degree] + (sine_table[degree + 1] - sine_table[degree]) * (angle % 10) / 10;
+  return sign * value;
+}
+
+int cosinus(int angle) {
+  return sinus(angle + 900);
+}
+
+int arcsinus(int value) { // Sine * 16384 to tenths of a degree.
+  int sign = value < 0 ? -1 : 1;
+  value = min(abs(value), 16384);
+  int low = 0;
+  int high = 90;
+  while (high - low > 1) {
+    int middle = (low + high) / 2;
+    if (sine_table[middle] <= value) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return sign * (low * 10 + (value - sine_table[low]) * 10 / max(sine_table[high] - sine_table[low], 1));
+}
+
+void getSunPosition(uint32_t u_time) { // Integer approximation of the sun's azimuth and elevation at geo_location, good to about a degree.
+  if (geo_location.length() < 2) {
+    sun_azimuth = -1;
+    return;
+  }
+  if (sun_position_location != geo_location) {
+    sun_latitude = round(geo_location.substring(0, geo_location.indexOf("x")).toFloat() * 10);
+    sun_longitude = round(geo_location.substring(geo_location.indexOf("x") + 1).toFloat() * 10);
+    sun_position_location = geo_location;
+  }
+
+  DateTime date(u_time);
+  int year_angle = (int32_t)3600 * (days_before_month[date.month() - 1] + date.day() - 81) / 366;
+  int declination = (int32_t)234 * sinus(year_angle) >> 14;
+  int time_equation = (((int32_t)987 * sinus(2 * year_angle) - (int32_t)753 * cosinus(year_angle) - (int32_t)150 * sinus(year_angle)) >> 14) / 10; // Tenths of a minute.
+  int solar_time = (date.hour() * 60 + date.minute()) * 10 + 4 * sun_longitude + time_equation; // Tenths of a minute.
+  int hour_angle = ((solar_time / 4 - 1800) % 3600 + 5400) % 3600 - 1800;
+
+  int sin_latitude = sinus(sun_latitude);
+  int cos_latitude = cosinus(sun_latitude);
+  int sin_declination = sinus(declination);
+  int sin_elevation = ((int32_t)sin_latitude * sin_declination + (int32_t)cos_latitude * cosinus(declination) / 16384 * cosinus(hour_angle)) >> 14;
+  sun_elevation = arcsinus(sin_elevation);
+
+  int32_t divisor = (int32_t)cosinus(sun_elevation) * cos_latitude >> 14;
+  int32_t cos_azimuth = divisor == 0 ? 0 : (((int32_t)sin_declination * 16384 - (int32_t)sin_elevation * sin_latitude) / divisor);
+  sun_azimuth = 900 - arcsinus(constrain(cos_azimuth, -16384, 16384));
+  if (hour_angle > 0) {
+    sun_azimuth = 3600 - sun_azimuth;
+  }
+}
+
 int findMDNSDevices() {
+  for (int i = devices_count - 1; i >= 0; i--) {
+    if (devices_array[i].failures > 2) {
+      removeDevice(i);
+    }
+  }
+
   int n = MDNS.queryService("idom", "tcp");
 
-  if (n > 0) {
-    delete [] devices_array;
-    devices_array = new Device[n];
-    devices_count = n;
+  for (int i = 0; i < n; ++i) {
+    addDevice(MDNS.IP(i).toString());
+  }
+  devices_discovery_millis = millis();
+  devices_stale = false;
+
+  return devices_count;
+}
+
+int getDevices() {
+  if (devices_stale || devices_count == 0 || millis() - devices_discovery_millis > devices_ttl) {
+    findMDNSDevices();
+  }
+  return devices_count;
+}
+
+int addDevice(String ip) {
+  if (ip == WiFi.localIP().toString()) {
+    return -1;
+  }
+  for (int i = 0; i < devices_count; i++) {
+    if (devices_array[i].ip == ip) {
+      return i;
+    }
+  }
+  if (devices_count == max_devices) {
+    return -1;
+  }
+
+  devices_array[devices_count] = Device();
+  devices_array[devices_count].ip = ip;
+  saveDevices();
+
+  return devices_count++;
+}
+
+void setDeviceId(String ip, String mac) {
+  for (int i = 0; i < devices_count; i++) {
+    if (devices_array[i].mac == mac) {
+      if (devices_array[i].ip != ip) {
+        devices_array[i].ip = ip;
+        devices_array[i].failures = 0;
+        saveDevices();
+      }
+      return;
+    }
+  }
+
+  int i = addDevice(ip);
+  if (i > -1 && devices_array[i].mac != mac) {
+    devices_array[i].mac = mac;
+    saveDevices();
+  }
+}
+
+void removeDevice(int index) {
+  for (int i = index; i < devices_count - 1; i++) {
+    devices_array[i] = devices_array[i + 1];
+  }
+  devices_count--;
+  saveDevices();
+}
+
+void hasDeviceFailed(int index, bool failed) {
+  if (!failed) {
+    devices_array[index].failures = 0;
+    return;
+  }
+  if (++devices_array[index].failures > 2) {
+    devices_stale = true;
+  }
+}
+
+void readDevices() {
+  File file = LittleFS.open("/devices.txt", "r");
+  if (!file) {
+    return;
+  }
+
+  DynamicJsonDocument json_object(1024);
+  DeserializationError deserialization_error = deserializeJson(json_object, file);
+  file.close();
+
+  if (deserialization_error) {
+    note("Devices error: " + String(deserialization_error.c_str()));
+    return;
+  }
+
+  devices_count = min((int)json_object["devices"].size(), max_devices);
+  for (int i = 0; i < devices_count; i++) {
+    devices_array[i] = Device();
+    devices_array[i].ip = json_object["devices"][i][0].as<String>();
+    devices_array[i].mac = json_object["devices"][i][1].as<String>();
+  }
+  devices_discovery_millis = millis();
+  devices_stale = devices_count == 0;
+}
+
+void saveDevices() {
+  DynamicJsonDocument json_object(1024);
+
+  for (int i = 0; i < devices_count; i++) {
+    json_object["devices"][i][0] = devices_array[i].ip;
+    json_object["devices"][i][1] = devices_array[i].mac;
+  }
 
-    for (int i = 0; i < n; ++i) {
-      devices_array[i].ip = String(MDNS.IP(i)[0]) + '.' + String(MDNS.IP(i)[1]) + '.' + String(MDNS.IP(i)[2]) + '.' + String(MDNS.IP(i)[3]);
+  if (devices_count > 0) {
+    writeObjectToFile("devices", json_object);
+  } else {
+    if (LittleFS.exists("/devices.txt")) {
+      LittleFS.remove("/devices.txt");
     }
   }
+}
 
-  return n;
+void onMDNSAnswer(MDNSResponder::MDNSServiceInfo service_info, MDNSResponder::AnswerType answer_type, bool set_content) {
+  if (answer_type != MDNSResponder::AnswerType::IP4Address || !set_content) {
+    return;
+  }
+  for (IPAddress ip : service_info.IP4Adresses()) {
+    addDevice(ip.toString());
+  }
 }
 
 void receivedOfflineData() {
   if (server.hasArg("plain")) {
-    server.send(200, "text/plain", "Data has received");
-    readData(server.arg("plain"), true);
+    if (queueCommand(server.arg("plain"), isPeer(server.client().remoteIP().toString()))) {
+      server.send(200, "text/plain", "Data has received");
+    } else {
+      server.send(503, "text/plain", "Too many requests");
+    }
     return;
   }
 
   server.send(200, "text/plain", "Body not received");
 }
 
+bool queueCommand(const String& payload) {
+  return queueCommand(payload, false);
+}
+
+bool queueCommand(const String& payload, bool per_peer) {
+  if (command_count == max_commands) {
+    commands_dropped++;
+    return false;
+  }
+
+  int slot = (command_head + command_count++) % max_commands;
+  command_queue[slot] = payload;
+  command_per_peer[slot] = per_peer;
+  return true;
+}
+
+bool isPeer(const String& ip) {
+  for (int i = 0; i < devices_count; i++) {
+    if (devices_array[i].ip == ip) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void runCommand() {
+  if (command_count == 0) {
+    return;
+  }
+
+  String payload = command_queue[command_head];
+  bool per_peer = command_per_peer[command_head];
+  command_queue[command_head] = "";
+  command_head = (command_head + 1) % max_commands;
+  command_count--;
+  readData(payload, true, per_peer);
+}
+
+bool isSnapshotStale(Snapshot& snapshot) {
+  if (snapshot.text.length() > 0 && snapshot.generation == state_generation && millis() - snapshot.refreshed_millis < snapshot_age) {
+    return false;
+  }
+  snapshot.generation = state_generation;
+  snapshot.refreshed_millis = millis();
+  return true;
+}
+
 void putOfflineData(String url, String data) {
   if (WiFi.status() != WL_CONNECTED) {
     return;
@@ -1886,86 +3334,184 @@ void putMultiOfflineData(String data, bool log) {
     return;
   }
 
-  int count = findMDNSDevices();
+  int count = getDevices();
   if (count == 0) {
     return;
   }
 
-  int http_code;
-  String log_text = "";
+  DynamicJsonDocument json_object(512);
+  DynamicJsonDocument new_object(256);
+  if (deserializeJson(new_object, data)) {
+    return;
+  }
 
   for (int i = 0; i < count; i++) {
+    if (multicast && isAnnouncing(i)) {
+      continue;
+    }
+    if (devices_array[i].pending.length() > 0) {
+      deserializeJson(json_object, devices_array[i].pending);
+      for (JsonPair pair : new_object.as<JsonObject>()) {
+        json_object[pair.key()] = pair.value();
+      }
+      devices_array[i].pending = "";
+      serializeJson(json_object, devices_array[i].pending);
+    } else {
+      devices_array[i].pending = data;
+    }
+    devices_array[i].pending_log |= log;
+    devices_array[i].attempts = 0;
+    devices_array[i].retry_millis = millis();
+  }
+}
+
+void sendOfflineData() { // Sends to one peer per call, so a dead peer costs at most broadcast_timeout.
+  static int next = 0;
+
+  for (int k = 0; k < devices_count; k++) {
+    int i = (next + k) % devices_count;
+    if (devices_array[i].pending.length() == 0 || (int32_t)(millis() - devices_array[i].retry_millis) < 0) {
+      continue;
+    }
+    next = (i + 1) % devices_count;
+
     if (wifiClient.available() == 0) {
       wifiClient.stop();
     }
 
+    uint32_t start_millis = millis();
+    httpClient.setTimeout(broadcast_timeout);
     httpClient.begin(wifiClient, "http://" + devices_array[i].ip + "/set");
     httpClient.addHeader("Content-Type", "text/plain");
-    http_code = httpClient.PUT(data);
+    int http_code = httpClient.PUT(devices_array[i].pending);
+    httpClient.end();
+    httpClient.setTimeout(HTTPCLIENT_DEFAULT_TCP_TIMEOUT);
+    devices_array[i].latency_ms = millis() - start_millis;
 
-    if (log) {
-      if (http_code == HTTP_CODE_OK) {
-        log_text += "\n " + devices_array[i].ip;
-      } else {
-        log_text += "\n " + devices_array[i].ip + " - error "  + http_code;
+    if (http_code == HTTP_CODE_OK || ++devices_array[i].attempts >= broadcast_attempts) {
+      if (devices_array[i].pending_log) {
+        note(devices_array[i].pending + " transfer to " + devices_array[i].ip + (http_code == HTTP_CODE_OK ? "" : " - error " + String(http_code)));
       }
+      hasDeviceFailed(i, http_code != HTTP_CODE_OK);
+      devices_array[i].pending = "";
+      devices_array[i].pending_log = false;
+      devices_array[i].attempts = 0;
+    } else {
+      devices_array[i].retry_millis = millis() + (1000 << devices_array[i].attempts);
     }
-
-    httpClient.end();
+    return;
   }
+}
 
-  if (log) {
-    note(data + " transfer to " + String(count) + ":" + log_text);
+void beginMulticast() {
+  multicastUdp.stop();
+  if (multicast) {
+    multicastUdp.beginMulticast(WiFi.localIP(), multicast_address, multicast_port);
   }
 }
 
-void getOfflineData() {
-  if (WiFi.status() != WL_CONNECTED) {
+void announce(uint8_t fields) {
+  if (!multicast || WiFi.status() != WL_CONNECTED) {
     return;
   }
 
-  int count = findMDNSDevices();
-  if (count == 0) {
-    return;
+  Announcement announcement = {{'i', 'D'}, fields, sensor_twilight, ++announcement_sequence, (int16_t)light_sensor, {-1, -1, -1}, 0};
+  #ifdef blinds
+    for (int i = 0; i < 3; i++) {
+      announcement.position[i] = steps[i] > 0 ? getActual(i) : -1;
+    }
+  #endif
+  if (RTCisrunning()) {
+    announcement.time = rtc.now().unixtime() - offset - (dst ? 3600 : 0);
+  } else {
+    announcement.fields &= ~announce_time;
   }
 
-  int http_code;
-  String data;
-  String log_text = "";
+  multicastUdp.beginPacketMulticast(multicast_address, multicast_port, WiFi.localIP());
+  multicastUdp.write((uint8_t*)&announcement, sizeof(announcement));
+  multicastUdp.endPacket();
+}
 
-  for (int i = 0; i < count; i++) {
-    if (wifiClient.available() == 0) {
-      wifiClient.stop();
-    }
+void receiveAnnouncements() {
+  Announcement announcement;
 
-    httpClient.begin(wifiClient, "http://" + devices_array[i].ip + "/basicdata");
-    httpClient.addHeader("Content-Type", "text/plain");
-    http_code = httpClient.POST("");
-
-    if (http_code == HTTP_CODE_OK) {
-      if (httpClient.getSize() > 15) {
-        data = httpClient.getString();
-        log_text +=  "\n " + devices_array[i].ip + ": ";
-        if (strContains(data, "ip")) {
-          log_text += "{*," + data.substring(data.indexOf("\"offset"));
-        } else {
-          log_text += data;
-        }
-        readData(data, true);
+  while (multicastUdp.parsePacket() > 0) {
+    if (multicastUdp.read((uint8_t*)&announcement, sizeof(announcement)) != sizeof(announcement) || announcement.magic[0] != 'i' || announcement.magic[1] != 'D') {
+      continue;
+    }
+    int device = addDevice(multicastUdp.remoteIP().toString());
+    if (device == -1) {
+      continue;
+    }
+    if ((int32_t)(announcement.sequence - devices_array[device].sequence) <= 0 && devices_array[device].sequence - announcement.sequence < 64) {
+      continue; // Repeated or late; a bigger step back means the peer has restarted.
+    }
+    devices_array[device].sequence = announcement.sequence;
+    devices_array[device].announced_millis = max(millis(), 1UL);
+    if (announcement.fields & announce_position) {
+      for (int i = 0; i < 3; i++) {
+        devices_array[device].position[i] = announcement.position[i];
       }
-    } else {
-      log_text += "\n " + devices_array[i].ip + ": error " + http_code;
     }
 
-    httpClient.end();
+    String data = "";
+    if (announcement.fields & announce_light) {
+      data += ",\"light\":\"" + String(announcement.light) + ((announcement.fields & announce_twilight) && announcement.twilight ? "t" : "") + "\"";
+    }
+    if (announcement.fields & announce_time) {
+      data += ",\"time\":" + String(announcement.time);
+    }
+    if (data.length() > 0) {
+      readData("{" + data.substring(1) + "}", true, true);
+    }
+  }
+}
+
+bool isAnnouncing(int index) { // The peer was heard over multicast lately, so it needs no /set for the same values.
+  return devices_array[index].announced_millis > 0 && millis() - devices_array[index].announced_millis < announced_ttl;
+}
+
+void getOfflineData(int index) {
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+
+  if (wifiClient.available() == 0) {
+    wifiClient.stop();
+  }
+
+  String log_text = "Received data from " + devices_array[index].ip;
+  httpClient.begin(wifiClient, "http://" + devices_array[index].ip + "/basicdata");
+  httpClient.addHeader("Content-Type", "text/plain");
+  int http_code = httpClient.POST("");
+  hasDeviceFailed(index, http_code != HTTP_CODE_OK);
+
+  if (http_code == HTTP_CODE_OK) {
+    if (httpClient.getSize() > 15) {
+      String data = httpClient.getString();
+      if (strContains(data, "ip")) {
+        log_text += ": {*," + data.substring(data.indexOf("\"offset"));
+      } else {
+        log_text += ": " + data;
+      }
+      readData(data, true, true);
+    }
+  } else {
+    log_text += ": error " + String(http_code);
   }
 
-  note("Received data..." + log_text);
+  httpClient.end();
+  note(log_text);
 }
 
 void setupOTA() {
   ArduinoOTA.setHostname(host_name);
 
+  ArduinoOTA.onStart([]() {
+    flushSettings(true);
+    flushTheLog(true);
+  });
+
   ArduinoOTA.onEnd([]() {
     note("Software update over Wi-Fi");
   });
@@ -1989,14 +3535,242 @@ void setupOTA() {
   ArduinoOTA.begin();
 }
 
+void changeSmart(char operation) {
+  if ((operation != 'a' && !server.hasArg("id")) || ((operation == 'a' || operation == 'r') && !server.hasArg("plain"))) {
+    server.send(400, "text/plain", "Failed!");
+    return;
+  }
+
+  uint32_t id = operation == 'a' ? 0 : strtoul(server.arg("id").c_str(), nullptr, 10);
+  String single_smart_string = operation == 'a' || operation == 'r' ? server.arg("plain") : "";
+  int code = checkSmartOperation(operation, id, single_smart_string);
+  if (code != 200) {
+    server.send(code, "text/plain", "Failed!");
+    return;
+  }
+  uint32_t new_id = applySmartOperation(operation, id, single_smart_string);
+
+  logSmartOperation(operation, id, single_smart_string);
+  note("Smart " + String(operation) + " " + String(new_id));
+  server.send(200, "text/plain", String(new_id));
+}
+
+void addSmart() {
+  changeSmart('a');
+}
+
+void replaceSmart() {
+  changeSmart('r');
+}
+
+void removeSmart() {
+  changeSmart('x');
+}
+
+void enableSmart() {
+  changeSmart('e');
+}
+
+void disableSmart() {
+  changeSmart('d');
+}
+
 void getSmartDetail() {
-  String result;
-  serializeJson(getSmartJson(false), result);
-  server.send(200, "text/plain", result);
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  ChunkedPrint output;
+  printSmartJson(output, false);
+  output.flush();
+  server.sendContent("");
 }
 
 void getRawSmartDetail() {
-  String result;
-  serializeJson(getSmartJson(true), result);
-  server.send(200, "text/plain", result);
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  ChunkedPrint output;
+  printSmartJson(output, true);
+  output.flush();
+  server.sendContent("");
+}
+
+void IRAM_ATTR profile(int index, uint32_t start_us) {
+  uint32_t duration = micros() - start_us;
+  profile_array[index].count++;
+  profile_array[index].total_us += duration;
+  if (duration > profile_array[index].max_us) {
+    profile_array[index].max_us = duration;
+  }
+}
+
+void getPerformance() {
+  String reply = "\"loops\":" + String(loops_per_second);
+  reply += ",\"heap\":" + String(ESP.getFreeHeap());
+  reply += ",\"saves\":" + String(settings_requests);
+  reply += ",\"set_bytes\":" + String(set_memory);
+  reply += ",\"first_step\":" + String(first_step_millis);
+  reply += ",\"dropped\":" + String(commands_dropped);
+  for (int i = 0; i < devices_count; i++) {
+    reply += (i == 0 ? ",\"peers\":[[\"" : ",[\"") + devices_array[i].ip + "\"," + String(devices_array[i].latency_ms) + "," + String(devices_array[i].failures);
+    if (isAnnouncing(i)) {
+      reply += ",\"" + String(devices_array[i].position[0]) + ";" + String(devices_array[i].position[1]) + ";" + String(devices_array[i].position[2]) + "\"";
+    }
+    reply += "]";
+    reply += i == devices_count - 1 ? "]" : "";
+  }
+  for (int i = 0; i < profiles; i++) {
+    if (profile_array[i].count > 0) {
+      reply += ",\"" + String(profile_names[i]) + "\":[" + String(profile_array[i].count);
+      reply += "," + String((uint32_t)(profile_array[i].total_us / profile_array[i].count));
+      reply += "," + String(profile_array[i].max_us) + "]";
+    }
+  }
+  server.send(200, "text/plain", "{" + reply + "}");
+}
+
+void clearPerformance() {
+  settings_requests = 0;
+  set_memory = 0;
+  commands_dropped = 0;
+  for (int i = 0; i < profiles; i++) {
+    profile_array[i].count = 0;
+    profile_array[i].total_us = 0;
+    profile_array[i].max_us = 0;
+  }
+  server.send(200, "text/plain", "Done");
+}
+
+void flushSettings(bool force) {
+  if (settings_dirty && (force || millis() - settings_dirty_millis >= settings_window)) {
+    settings_dirty = false;
+    writeSettings(settings_log);
+    settings_log = false;
+  }
+}
+
+uint32_t getSettingsGeneration(bool backup) {
+  File file = LittleFS.open(backup ? "/backup.txt" : "/settings.txt", "r");
+  if (!file) {
+    return 0;
+  }
+
+  StaticJsonDocument<16> filter;
+  filter["gen"] = true;
+  StaticJsonDocument<32> json_object;
+  DeserializationError deserialization_error = deserializeJson(json_object, file, DeserializationOption::Filter(filter));
+  file.close();
+
+  return deserialization_error ? 0 : json_object["gen"].as<uint32_t>();
+}
+
+bool getSettingFlag(JsonVariant value) {
+  const char* text = value.as<const char*>();
+  return text != nullptr ? strchr(text, '1') != nullptr : value.as<int>() == 1;
+}
+
+void getSettingTriple(JsonVariant value, int triple[3]) { // "1;2;3" or a single value for all three.
+  const char* text = value.as<const char*>();
+  if (text == nullptr || strchr(text, ';') == nullptr) {
+    int single = text != nullptr ? atoi(text) : value.as<int>();
+    for (int i = 0; i < 3; i++) {
+      triple[i] = single;
+    }
+    return;
+  }
+  triple[0] = atoi(text);
+  triple[1] = strchr(text, ';') == strrchr(text, ';') ? 0 : atoi(strchr(text, ';') + 1);
+  triple[2] = atoi(strrchr(text, ';') + 1);
+}
+
+void readSetting(const Setting& setting, JsonVariant value) {
+  if (setting.type == setting_int) {
+    *(int*)setting.target = value.as<int>();
+  } else if (setting.type == setting_uint) {
+    *(uint32_t*)setting.target = value.as<uint32_t>();
+  } else if (setting.type == setting_bool) {
+    *(bool*)setting.target = !value.isNull();
+  } else if (setting.type == setting_string) {
+    *(String*)setting.target = value.as<String>();
+  } else if (setting.type == setting_triple) {
+    for (int i = 0; i < 3; i++) {
+      ((int*)setting.target)[i] = value[i].as<int>();
+    }
+  }
+}
+
+void writeSetting(const Setting& setting, JsonDocument& json_object) {
+  if (setting.type == setting_int) {
+    if (*(int*)setting.target != setting.fallback) {
+      json_object[setting.key] = *(int*)setting.target;
+    }
+  } else if (setting.type == setting_uint) {
+    if (*(uint32_t*)setting.target != (uint32_t)setting.fallback) {
+      json_object[setting.key] = *(uint32_t*)setting.target;
+    }
+  } else if (setting.type == setting_bool) {
+    if (*(bool*)setting.target) {
+      json_object[setting.key] = true;
+    }
+  } else if (setting.type == setting_string) {
+    if (((String*)setting.target)->length() > 0 || (setting.flags & setting_clearable)) {
+      json_object[setting.key] = *(String*)setting.target;
+    }
+  } else if (setting.type == setting_triple) {
+    int* triple = (int*)setting.target;
+    if (triple[0] + triple[1] + triple[2] > 0) {
+      for (int i = 0; i < 3; i++) {
+        json_object[setting.key][i] = triple[i];
+      }
+    }
+  }
+}
+
+bool receiveSetting(const Setting& setting, JsonVariant value) {
+  if (setting.type == setting_int) {
+    int new_value = value.as<int>();
+    if (*(int*)setting.target == new_value) {
+      return false;
+    }
+    *(int*)setting.target = new_value;
+  } else if (setting.type == setting_uint) {
+    uint32_t new_value = value.as<uint32_t>();
+    if (*(uint32_t*)setting.target == new_value) {
+      return false;
+    }
+    *(uint32_t*)setting.target = new_value;
+  } else if (setting.type == setting_bool) {
+    bool new_value = getSettingFlag(value);
+    if (*(bool*)setting.target == new_value) {
+      return false;
+    }
+    *(bool*)setting.target = new_value;
+  } else if (setting.type == setting_string) {
+    const char* text = value.as<const char*>();
+    if (text == nullptr || *(String*)setting.target == text) {
+      return false;
+    }
+    *(String*)setting.target = text;
+  } else if (setting.type == setting_triple) {
+    int* triple = (int*)setting.target;
+    int new_triple[3];
+    bool changed = false;
+    getSettingTriple(value, new_triple);
+    for (int i = 0; i < 3; i++) {
+      #ifdef blinds
+        if (steps[i] == 0) {
+          continue;
+        }
+      #endif
+      if (triple[i] != new_triple[i]) {
+        triple[i] = new_triple[i];
+        changed = true;
+      }
+    }
+    if (!changed) {
+      return false;
+    }
+  }
+  if (setting.hook != nullptr) {
+    setting.hook();
+  }
+  return true;
 }
@@ -7,7 +7,7 @@ void setup() {
   LittleFS.begin();
   Wire.begin();
 
-  keep_log = LittleFS.exists("/log.txt");
+  readTheLog();
 
   #ifdef physical_clock
     rtc.begin();
@@ -19,10 +19,12 @@ void setup() {
   sprintf(host_name, "blinds_%s", String(WiFi.macAddress()).c_str());
   WiFi.hostname(host_name);
 
-  if (!readSettings(0)) {
+  bool backup = getSettingsGeneration(true) > getSettingsGeneration(false);
+  if (!readSettings(backup)) {
     delay(1000);
-    readSettings(1);
+    readSettings(!backup);
   }
+  replaySmartLog();
   resume();
 
   if (RTCisrunning()) {
@@ -44,29 +46,42 @@ void setup() {
   pinMode(bipolar_step_pin, OUTPUT);
   setStepperOff();
   setupOTA();
-  connectingToWifi(false);
 }
 
 void loop() {
-  if (WiFi.status() == WL_CONNECTED) {
+  if (wifi_state != wifi_ready) {
+    connectingToWifi();
+  }
+
+  if (WiFi.status() == WL_CONNECTED && auto_reconnect) {
     if (destination[0] == actual[0] && destination[1] == actual[1] && destination[2] == actual[2]) {
       ArduinoOTA.handle();
     }
     server.handleClient();
+    runCommand();
     MDNS.update();
+    pushEvents();
+    sendOfflineData();
+    receiveTime();
+    if (multicast) {
+      receiveAnnouncements();
+    }
   } else {
-    if (!auto_reconnect) {
-      connectingToWifi(true);
+    if (WiFi.status() != WL_CONNECTED) {
+      cancelMeasurement();
     }
-    cancelMeasurement();
   }
 
   if (measurement) {
-    measurementRotation();
+    startStepper();
     return;
   }
 
+  dispatchMotion();
+
   if (hasTimeChanged()) {
+    flushSettings(false);
+    flushTheLog(false);
     if (destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2]) {
       if (loop_u_time % 2 == 0) {
         if (loop_u_time % 4 == 0) {
@@ -82,19 +97,24 @@ void loop() {
   }
 
   if (destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2]) {
-    rotation();
-    if (destination[0] == actual[0] && destination[1] == actual[1] && destination[2] == actual[2]) {
+    startStepper();
+  } else {
+    if (stepping) {
+      stopStepper();
       setStepperOff();
-      if (LittleFS.exists("/resume.txt")) {
-        LittleFS.remove("/resume.txt");
-      }
+      saveSettings(false);
+      announce(announce_position);
     }
   }
 }
 
 
 String toPercentages(int value, int steps) {
-  return String(value > 0 && steps > 0 ? (int)round((value + 0.0) * 100 / steps) : 0);
+  return String(toPercent(value, steps));
+}
+
+int toPercent(int value, int steps) {
+  return value > 0 && steps > 0 ? (int)round((value + 0.0) * 100 / steps) : 0;
 }
 
 int toSteps(int value, int steps) {
@@ -102,6 +122,56 @@ int toSteps(int value, int steps) {
 }
 
 
+void limitAcceleration() {
+  acceleration = max(acceleration, 0);
+}
+
+void limitCruise() {
+  cruise = constrain(cruise, 500, step_interval);
+}
+
+const Setting settings_table[] = {
+  {"log", setting_int, &last_accessed_log, 0, setting_saved, nullptr},
+  {"ssid", setting_string, &ssid, 0, setting_saved, nullptr},
+  {"password", setting_string, &password, 0, setting_saved, nullptr},
+  {"offset", setting_int, &offset, 0, setting_saved, nullptr},
+  {"dst", setting_bool, &dst, 0, setting_saved, nullptr},
+  {"smart_lock", setting_bool, &smart_lock, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"location", setting_string, &geo_location, 0, setting_saved | setting_received | setting_details | setting_clearable, setLocation},
+  {"sunset", setting_uint, &sunset_u_time, 0, setting_saved, nullptr},
+  {"sunrise", setting_uint, &sunrise_u_time, 0, setting_saved, nullptr},
+  {"sensor_twilight", setting_bool, &sensor_twilight, 0, setting_saved, nullptr},
+  {"twilight", setting_bool, &calendar_twilight, 0, setting_saved, nullptr},
+  {"boundary", setting_int, &boundary, default_boundary, setting_saved | setting_received | setting_details, nullptr},
+  {"reversed", setting_bool, &reversed, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"separately", setting_bool, &separately, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"inverted", setting_bool, &inverted_sequence, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"tandem", setting_bool, &tandem, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"multicast", setting_bool, &multicast, 0, setting_saved | setting_received, beginMulticast},
+  {"acceleration", setting_int, &acceleration, 0, setting_saved | setting_received | setting_details, limitAcceleration},
+  {"cruise", setting_int, &cruise, default_cruise, setting_saved | setting_received | setting_details, limitCruise},
+  {"fixit", setting_triple, fixit, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"cycles", setting_triple, cycles, 0, setting_saved, nullptr},
+  {"day_night", setting_triple, day_night, 0, setting_saved | setting_received | setting_details, nullptr},
+  {"steps", setting_triple, steps, 0, setting_saved, nullptr},
+  {"dusk", setting_uint, &dusk_u_time, 0, setting_saved, nullptr},
+  {"dawn", setting_uint, &dawn_u_time, 0, setting_saved, nullptr},
+  {"overstep", setting_uint, &overstep_u_time, 0, setting_saved, nullptr}
+};
+const char* const set_keys[] = {"calibrate", "wings", "positioning", "ip", "id", "offset", "dst", "time", "smart", "light", "val", "blinds", "apk", "motion", "steps1", "steps2", "steps3"}; // Handled outside of the table.
+StaticJsonDocument<JSON_OBJECT_SIZE(48)> set_filter;
+
+void buildSetFilter() {
+  for (const Setting& setting : settings_table) {
+    if (setting.flags & setting_received) {
+      set_filter[setting.key] = true;
+    }
+  }
+  for (const char* key : set_keys) {
+    set_filter[key] = true;
+  }
+}
+
 bool readSettings(bool backup) {
   File file = LittleFS.open(backup ? "/backup.txt" : "/settings.txt", "r");
   if (!file) {
@@ -122,22 +192,12 @@ bool readSettings(bool backup) {
   note("Reading the " + String(backup ? "backup" : "settings") + " file:\n " + file.readString());
   file.close();
 
-  if (json_object.containsKey("log")) {
-    last_accessed_log = json_object["log"].as<int>();
-  }
-  if (json_object.containsKey("ssid")) {
-    ssid = json_object["ssid"].as<String>();
-  }
-  if (json_object.containsKey("password")) {
-    password = json_object["password"].as<String>();
+  if (json_object.containsKey("gen")) {
+    settings_generation = json_object["gen"].as<uint32_t>();
   }
   if (json_object.containsKey("uprisings")) {
     uprisings = json_object["uprisings"].as<int>() + 1;
   }
-  if (json_object.containsKey("offset")) {
-    offset = json_object["offset"].as<int>();
-  }
-  dst = json_object.containsKey("dst");
   if (json_object.containsKey("smart")) {
     if (json_object.containsKey("ver")) {
       setSmart(json_object["smart"].as<String>());
@@ -145,56 +205,26 @@ bool readSettings(bool backup) {
       setSmart(oldSmart2NewSmart(json_object["smart"].as<String>()));
     }
   }
-  smart_lock = json_object.containsKey("smart_lock");
-  if (json_object.containsKey("location")) {
-    geo_location = json_object["location"].as<String>();
-    if (geo_location.length() > 2) {
-      sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
+  for (const Setting& setting : settings_table) {
+    if (!(setting.flags & setting_saved)) {
+      continue;
+    }
+    if (setting.type == setting_bool || json_object.containsKey(setting.key)) {
+      readSetting(setting, json_object[setting.key]);
+    } else if (setting.type == setting_triple) {
+      char legacy_key[16];
+      for (int i = 0; i < 3; i++) {
+        snprintf(legacy_key, sizeof(legacy_key), "%s%d", setting.key, i + 1);
+        if (json_object.containsKey(legacy_key)) {
+          ((int*)setting.target)[i] = json_object[legacy_key].as<int>();
+        }
+      }
     }
   }
-  if (json_object.containsKey("sunset")) {
-    sunset_u_time = json_object["sunset"].as<int>();
-  }
-  if (json_object.containsKey("sunrise")) {
-    sunrise_u_time = json_object["sunrise"].as<int>();
-  }
-  sensor_twilight = json_object.containsKey("sensor_twilight");
-  calendar_twilight = json_object.containsKey("twilight");
-  if (json_object.containsKey("boundary")) {
-    boundary = json_object["boundary"].as<int>();
+  if (geo_location.length() > 2) {
+    sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
   }
-  reversed = json_object.containsKey("reversed");
-  separately = json_object.containsKey("separately");
-  tandem = json_object.containsKey("tandem");
   for (int i = 0; i < 3; i++) {
-    if (json_object.containsKey("fixit")) {
-      fixit[i] = json_object["fixit"][i].as<int>();
-    } else {
-      if (json_object.containsKey("fixit" + String(i + 1))) {
-        fixit[i] = json_object["fixit" + String(i + 1)].as<int>();
-      }
-    }
-    if (json_object.containsKey("cycles")) {
-      cycles[i] = json_object["cycles"][i].as<int>();
-    } else {
-      if (json_object.containsKey("cycles" + String(i + 1))) {
-        cycles[i] = json_object["cycles" + String(i + 1)].as<int>();
-      }
-    }
-    if (json_object.containsKey("day_night")) {
-      day_night[i] = json_object["day_night"][i].as<int>();
-    } else {
-      if (json_object.containsKey("day_night" + String(i + 1))) {
-        day_night[i] = json_object["day_night" + String(i + 1)].as<int>();
-      }
-    }
-    if (json_object.containsKey("steps")) {
-      steps[i] = json_object["steps"][i].as<int>();
-    } else {
-      if (json_object.containsKey("steps" + String(i + 1))) {
-        steps[i] = json_object["steps" + String(i + 1)].as<int>();
-      }
-    }
     if (json_object.containsKey("destination") || json_object.containsKey("destination" + String(i + 1))) {
       if (json_object.containsKey("destination")) {
         destination[i] = json_object["destination"][i].as<int>();
@@ -210,15 +240,6 @@ bool readSettings(bool backup) {
       actual[i] = destination[i];
     }
   }
-  if (json_object.containsKey("dusk")) {
-    dusk_u_time = json_object["dusk"].as<int>();
-  }
-  if (json_object.containsKey("dawn")) {
-    dawn_u_time = json_object["dawn"].as<int>();
-  }
-  if (json_object.containsKey("overstep")) {
-    overstep_u_time = json_object["overstep"].as<int>();
-  }
 
   saveSettings(false);
 
@@ -230,122 +251,107 @@ void saveSettings() {
 }
 
 void saveSettings(bool log) {
+  state_generation++;
+  settings_requests++;
+  settings_log |= log;
+  if (!settings_dirty) {
+    settings_dirty = true;
+    settings_dirty_millis = millis();
+  }
+}
+
+void writeSettings(bool log) {
+  uint32_t start_us = micros();
   DynamicJsonDocument json_object(1024);
+  bool backup = ++settings_generation % 2 == 0;
 
   json_object["ver"] = String(version) + "." + String(core_version);
-  if (last_accessed_log > 0) {
-    json_object["log"] = last_accessed_log;
-  }
-  if (ssid.length() > 0) {
-    json_object["ssid"] = ssid;
-  }
-  if (password.length() > 0) {
-    json_object["password"] = password;
-  }
+  json_object["gen"] = settings_generation;
   json_object["uprisings"] = uprisings;
-  if (offset > 0) {
-    json_object["offset"] = offset;
-  }
-  if (dst) {
-    json_object["dst"] = dst;
-  }
   if (smart_count > 0) {
     json_object["smart"] = getSmartString(true);
   }
-  if (smart_lock) {
-    json_object["smart_lock"] = smart_lock;
-  }
-  if (geo_location != default_location) {
-    json_object["location"] = geo_location;
-  }
-  if (sunset_u_time > 0) {
-    json_object["sunset"] = sunset_u_time;
-  }
-  if (sunrise_u_time > 0) {
-    json_object["sunrise"] = sunrise_u_time;
-  }
-  if (sensor_twilight) {
-    json_object["sensor_twilight"] = sensor_twilight;
-  }
-  if (calendar_twilight) {
-    json_object["twilight"] = calendar_twilight;
-  }
-  if (boundary != default_boundary) {
-    json_object["boundary"] = boundary;
-  }
-  if (reversed) {
-    json_object["reversed"] = reversed;
-  }
-  if (separately) {
-    json_object["separately"] = separately;
-  }
-  if (inverted_sequence) {
-    json_object["inverted"] = inverted_sequence;
-  }
-  if (tandem) {
-    json_object["tandem"] = tandem;
-  }
-  for (int i = 0; i < 3; i++) {
-    if (fixit[0] + fixit[1] + fixit[2] > 0) {
-      json_object["fixit"][i] = fixit[i];
-    }
-    if (cycles[0] + cycles[1] + cycles[2] > 0) {
-      json_object["cycles"][i] = cycles[i];
+  for (const Setting& setting : settings_table) {
+    if (setting.flags & setting_saved) {
+      writeSetting(setting, json_object);
     }
-    if (day_night[0] + day_night[1] + day_night[2] > 0) {
-      json_object["day_night"][i] = day_night[i];
-    }
-    if (steps[0] + steps[1] + steps[2] > 0) {
-      json_object["steps"][i] = steps[i];
-    }
-    if (destination[0] + destination[1] + destination[2] > 0) {
-      json_object["destination"][i] = destination[i];
-    }
-  }
-  if (dusk_u_time > 0) {
-    json_object["dusk"] = dusk_u_time;
-  }
-  if (dawn_u_time > 0) {
-    json_object["dawn"] = dawn_u_time;
   }
-  if (overstep_u_time > 0) {
-    json_object["overstep"] = overstep_u_time;
+  if (destination[0] + destination[1] + destination[2] > 0) {
+    for (int i = 0; i < 3; i++) {
+      json_object["destination"][i] = (int)destination[i];
+    }
   }
 
-  if (writeObjectToFile("settings", json_object)) {
+  if (writeObjectToFile(backup ? "backup" : "settings", json_object)) {
+    clearSmartLog();
+    if (destination[0] == actual[0] && destination[1] == actual[1] && destination[2] == actual[2]) {
+      clearJournal(); // The saved destination is where the wings stand.
+    }
     if (log) {
       String log_text;
       serializeJson(json_object, log_text);
       note("Saving settings:\n " + log_text);
     }
-
-    writeObjectToFile("backup", json_object);
   } else {
     note("Saving the settings failed!");
   }
+
+  profile(profile_settings, start_us);
 }
 
 void resume() {
-  File file = LittleFS.open("/resume.txt", "r");
-  if (!file) {
-    return;
+  JournalRecord record;
+  JournalRecord latest;
+  bool found = false;
+
+  for (int i = 0; i < 2; i++) {
+    File file = LittleFS.open("/journal" + String(i) + ".bin", "r");
+    if (!file) {
+      continue;
+    }
+    while (file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+      if (record.crc != crc32(&record, offsetof(JournalRecord, crc))) {
+        break;
+      }
+      if (!found || record.sequence > latest.sequence) {
+        latest = record;
+        found = true;
+        journal_file = i;
+      }
+    }
+    file.close();
   }
 
-  StaticJsonDocument<100> json_object;
-  DeserializationError deserialization_error = deserializeJson(json_object, file);
-  file.close();
+  if (found) {
+    journal_sequence = latest.sequence;
+    journal_count = journal_records; // The next record starts the other file, so a torn tail is never appended to.
+    for (int i = 0; i < 3; i++) {
+      actual[i] = latest.actual[i];
+      destination[i] = constrain(latest.destination[i], 0, steps[i]);
+    }
+  } else {
+    File file = LittleFS.open("/resume.txt", "r");
+    if (!file) {
+      return;
+    }
 
-  if (deserialization_error) {
-    note("Resume error: " + String(deserialization_error.c_str()));
-    return;
-  }
+    StaticJsonDocument<100> json_object;
+    DeserializationError deserialization_error = deserializeJson(json_object, file);
+    file.close();
+    LittleFS.remove("/resume.txt");
 
-  for (int i = 0; i < 3; i++) {
-    if (json_object.containsKey("actual")) {
-      actual[i] = json_object["actual"][i].as<int>();
-    } else {
-      if (json_object.containsKey(String(i + 1))) {
-        actual[i] = json_object[String(i + 1)].as<int>();
+    if (deserialization_error) {
+      note("Resume error: " + String(deserialization_error.c_str()));
+      return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+      if (json_object.containsKey("actual")) {
+        actual[i] = json_object["actual"][i].as<int>();
+      } else {
+        if (json_object.containsKey(String(i + 1))) {
+          actual[i] = json_object[String(i + 1)].as<int>();
+        }
       }
     }
   }
@@ -358,21 +364,47 @@ void resume() {
       }
     }
     note("Resume: " + log_text);
-  } else {
-    if (LittleFS.exists("/resume.txt")) {
-      LittleFS.remove("/resume.txt");
+    if (!found) {
+      saveTheState();
     }
+  } else {
+    clearJournal();
   }
 }
 
 void saveTheState() {
-  StaticJsonDocument<100> json_object;
+  JournalRecord record;
 
+  record.sequence = ++journal_sequence;
   for (int i = 0; i < 3; i++) {
-    json_object["actual"][i] = actual[i];
+    record.actual[i] = actual[i];
+    record.destination[i] = destination[i];
+  }
+  record.crc = crc32(&record, offsetof(JournalRecord, crc));
+
+  if (journal_count >= journal_records) {
+    journal_file = 1 - journal_file;
+    journal_count = 0;
   }
 
-  writeObjectToFile("resume", json_object);
+  File file = LittleFS.open("/journal" + String(journal_file) + ".bin", journal_count == 0 ? "w" : "a");
+  if (!file) {
+    note("Saving the state failed!");
+    return;
+  }
+  file.write((uint8_t*)&record, sizeof(record));
+  file.close();
+  journal_count++;
+}
+
+void clearJournal() {
+  for (int i = 0; i < 2; i++) {
+    if (LittleFS.exists("/journal" + String(i) + ".bin")) {
+      LittleFS.remove("/journal" + String(i) + ".bin");
+    }
+  }
+  journal_file = 0;
+  journal_count = 0;
 }
 
 
@@ -417,7 +449,7 @@ String getValue(String separator) {
 }
 
 int getValue(int number) {
-  return toPercentages(destination[number], steps[number]).toInt();
+  return toPercent(destination[number], steps[number]);
 }
 
 String getActual() {
@@ -428,6 +460,10 @@ String getActual(bool complete) {
   return actual[0] + actual[1] + actual[2] > 0 || complete ? (toPercentages(actual[0], steps[0]) + ";" + toPercentages(actual[1], steps[1]) + ";" + toPercentages(actual[2], steps[2])) : "0";
 }
 
+int getActual(int number) {
+  return toPercent(actual[number], steps[number]);
+}
+
 String getSensorDetail(bool basic) {
   return has_a_sensor ? (String(light_sensor) + (sensor_twilight ? "t" : "") + (!basic && twilight_counter > 0 ? (";" + String(twilight_counter)) : "")) : "-1";
 }
@@ -436,14 +472,22 @@ void startServices() {
   server.on("/hello", HTTP_POST, handshake);
   server.on("/set", HTTP_PUT, receivedOfflineData);
   server.on("/state", HTTP_GET, requestForState);
+  server.on("/events", HTTP_GET, requestForEvents);
   server.on("/basicdata", HTTP_POST, exchangeOfBasicData);
   server.on("/measurement/start", HTTP_POST, makeMeasurement);
   server.on("/measurement/cancel", HTTP_POST, cancelMeasurement);
   server.on("/measurement/end", HTTP_POST, endMeasurement);
   server.on("/log", HTTP_GET, requestForLogs);
   server.on("/log", HTTP_DELETE, clearTheLog);
+  server.on("/smart", HTTP_POST, addSmart);
+  server.on("/smart", HTTP_PUT, replaceSmart);
+  server.on("/smart", HTTP_DELETE, removeSmart);
+  server.on("/smart/enabled", HTTP_POST, enableSmart);
+  server.on("/smart/enabled", HTTP_DELETE, disableSmart);
   server.on("/test/smartdetail", HTTP_GET, getSmartDetail);
   server.on("/test/smartdetail/raw", HTTP_GET, getRawSmartDetail);
+  server.on("/test/performance", HTTP_GET, getPerformance);
+  server.on("/test/performance", HTTP_DELETE, clearPerformance);
   server.on("/admin/reset", HTTP_POST, setMin);
   server.on("/admin/setmax", HTTP_POST, setMax);
   server.on("/admin/setasmax", HTTP_POST, setAsMax);
@@ -456,23 +500,56 @@ void startServices() {
   note(String(host_name) + (MDNS.begin(host_name) ? " started" : " unsuccessful!"));
 
   MDNS.addService("idom", "tcp", 8080);
-
-  ntpClient.begin();
-  ntpClient.update();
-  readData("{\"time\":" + String(ntpClient.getEpochTime()) + "}", false);
-  getOfflineData();
+  readDevices();
+  beginMulticast();
+  MDNS.installServiceQuery("idom", "tcp", onMDNSAnswer);
 }
 
 void handshake() {
   bool per_rest_client = false;
 
   if (server.hasArg("plain")) {
-    readData(server.arg("plain"), true);
+    if (!queueCommand(server.arg("plain"))) {
+      server.send(503, "text/plain", "Too many requests");
+      return;
+    }
   } else {
     per_rest_client = true;
   }
 
-  String reply = "\"id\":\"" + WiFi.macAddress() + "\"";
+  if (hello_generation[per_rest_client] != state_generation || hello_cache[per_rest_client].length() == 0) {
+    getHello(per_rest_client);
+    hello_generation[per_rest_client] = state_generation;
+  }
+
+  String value = getValue(per_rest_client ? "," : ";");
+  String reply;
+  reply.reserve(hello_cache[per_rest_client].length() + 96);
+  reply = "{";
+  reply += hello_cache[per_rest_client];
+  if (start_u_time == 0) {
+    reply += ",\"active\":" + String(millis() / 1000);
+  }
+  if (RTCisrunning()) {
+    reply += ",\"time\":" + String(rtc.now().unixtime() - offset - (dst ? 3600 : 0));
+  }
+  if (value != "0") {
+    reply += ",\"value\":[" + value + "]";
+  }
+  if (getActual() != getValue()) {
+    reply += ",\"pos\":[" + getActual(per_rest_client ? "," : ";") + "]";
+  }
+  reply += "}";
+
+  Serial.print("\nHandshake");
+  server.send(200, "text/plain", reply);
+}
+
+void getHello(bool per_rest_client) { // Rebuilds the part of the handshake that changes only with state_generation.
+  String& reply = hello_cache[per_rest_client];
+  reply = "";
+  reply.reserve(1024);
+  reply += "\"id\":\"" + WiFi.macAddress() + "\"";
   reply += ",\"version\":" + String(version) + "." + String(core_version);
   reply += ",\"offline\":true";
   if (keep_log) {
@@ -480,8 +557,6 @@ void handshake() {
   }
   if (start_u_time > 0) {
     reply += ",\"start\":" + String(start_u_time);
-  } else {
-    reply += ",\"active\":" + String(millis() / 1000);
   }
   reply += ",\"uprisings\":" + String(uprisings);
   if (offset > 0) {
@@ -490,12 +565,11 @@ void handshake() {
   if (dst) {
     reply += ",\"dst\":true";
   }
-  if (RTCisrunning()) {
-    #ifdef physical_clock
+  #ifdef physical_clock
+    if (RTCisrunning()) {
       reply += ",\"rtc\":true";
-    #endif
-    reply += ",\"time\":" + String(rtc.now().unixtime() - offset - (dst ? 3600 : 0));
-  }
+    }
+  #endif
   if (smart_count > 0) {
     reply += ",\"smart\":\"" + getSmartString(true) + "\"";
   }
@@ -542,6 +616,15 @@ void handshake() {
   if (tandem) {
     reply += ",\"tandem\":true";
   }
+  if (multicast) {
+    reply += ",\"multicast\":true";
+  }
+  if (acceleration > 0) {
+    reply += ",\"acceleration\":" + String(acceleration);
+  }
+  if (cruise != default_cruise) {
+    reply += ",\"cruise\":" + String(cruise);
+  }
   if (getFixit() != "0") {
     reply += ",\"fixit\":[" + getFixit(per_rest_client ? "," : ";")  + "]";
   }
@@ -554,12 +637,6 @@ void handshake() {
   if (getSteps() != "0") {
     reply += ",\"steps\":[" + getSteps(per_rest_client ? "," : ";") + "]";
   }
-  if (getValue() != "0") {
-    reply += ",\"value\":[" + getValue(per_rest_client ? "," : ";") + "]";
-  }
-  if (getActual() != getValue()) {
-    reply += ",\"pos\":[" + getActual(per_rest_client ? "," : ";") + "]";
-  }
   if (has_a_sensor) {
     reply += ",\"has_a_sensor\":true";
   }
@@ -572,14 +649,22 @@ void handshake() {
   if (overstep_u_time > 0) {
     reply += ",\"overstep\":" + String(overstep_u_time);
   }
-
-  Serial.print("\nHandshake");
-  server.send(200, "text/plain", "{" + reply + "}");
 }
 
 void requestForState() {
+  if (isSnapshotStale(state_snapshot)) {
+    state_snapshot.text = getState();
+  }
+  server.send(200, "text/plain", state_snapshot.text);
+}
+
+String getState() {
   String reply = "\"value\":[" + getValue() + "]";
 
+  if (getMotionQueue() > 0) {
+    reply += ",\"queue\":" + String(getMotionQueue());
+  }
+
   if (!measurement && getActual() != getValue()) {
     reply += ",\"pos\":[" + getActual() + "]";
   }
@@ -588,14 +673,91 @@ void requestForState() {
     reply += ",\"light\":\"" + getSensorDetail(false) + "\"";
   }
 
-  server.send(200, "text/plain", "{" + reply + "}");
+  return "{" + reply + "}";
+}
+
+void requestForEvents() {
+  int slot = -1;
+  for (int i = 0; i < max_event_clients; i++) {
+    if (!event_clients[i] || !event_clients[i].connected()) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1) {
+    server.send(503, "text/plain", "Too many listeners");
+    return;
+  }
+
+  event_clients[slot] = server.client();
+  event_clients[slot].setNoDelay(true);
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.sendContent("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nConnection: keep-alive\r\nCache-Control: no-cache\r\n\r\n");
+  event_clients[slot].print("data: " + getState() + "\n\n");
+}
+
+void pushEvents() { // Sends what changed since the last event, at most once per second while moving.
+  bool listening = false;
+  for (int i = 0; i < max_event_clients; i++) {
+    if (event_clients[i]) {
+      if (event_clients[i].connected()) {
+        listening = true;
+      } else {
+        event_clients[i].stop();
+      }
+    }
+  }
+  if (!listening || (stepping && millis() - event_millis < 1000)) {
+    return;
+  }
+
+  String reply = "";
+  if (destination[0] != event_destination[0] || destination[1] != event_destination[1] || destination[2] != event_destination[2]) {
+    reply += ",\"value\":[" + getValue() + "]";
+  }
+  if (!measurement && (actual[0] != event_actual[0] || actual[1] != event_actual[1] || actual[2] != event_actual[2])) {
+    reply += ",\"pos\":[" + getActual(true) + "]";
+  }
+  if (has_a_sensor && (light_sensor != event_light || sensor_twilight != event_twilight[0])) {
+    reply += ",\"light\":\"" + getSensorDetail(false) + "\"";
+  }
+  if (calendar_twilight != event_twilight[1]) {
+    reply += ",\"twilight\":" + String(calendar_twilight ? "true" : "false");
+  }
+  if (reply.length() == 0) {
+    return;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    event_destination[i] = destination[i];
+    event_actual[i] = actual[i];
+  }
+  event_light = light_sensor;
+  event_twilight[0] = sensor_twilight;
+  event_twilight[1] = calendar_twilight;
+  event_millis = millis();
+
+  reply = "data: {" + reply.substring(1) + "}\n\n";
+  for (int i = 0; i < max_event_clients; i++) {
+    if (event_clients[i] && event_clients[i].connected()) {
+      event_clients[i].print(reply);
+    }
+  }
 }
 
 void exchangeOfBasicData() {
-  if (server.hasArg("plain")) {
-    readData(server.arg("plain"), true);
+  if (server.hasArg("plain") && !queueCommand(server.arg("plain"))) {
+    server.send(503, "text/plain", "Too many requests");
+    return;
   }
 
+  if (isSnapshotStale(basic_snapshot)) {
+    basic_snapshot.text = getBasicData();
+  }
+  server.send(200, "text/plain", basic_snapshot.text);
+}
+
+String getBasicData() {
   String reply = "\"ip\":\"" + WiFi.localIP().toString() + "\"" + ",\"id\":\"" + WiFi.macAddress() + "\"";
 
   reply += ",\"offset\":" + String(offset) + ",\"dst\":" + String(dst);
@@ -608,17 +770,27 @@ void exchangeOfBasicData() {
     reply += ",\"light\":\"" + getSensorDetail(true) + "\"";
   }
 
-  server.send(200, "text/plain", "{" + reply + "}");
+  return "{" + reply + "}";
 }
 
 void readData(const String& payload, bool per_wifi) {
+  readData(payload, per_wifi, false);
+}
+
+void readData(const String& payload, bool per_wifi, bool per_peer) {
+  uint32_t start_us = micros();
+  if (set_filter.isNull()) {
+    buildSetFilter();
+  }
+
   DynamicJsonDocument json_object(1024);
-  DeserializationError deserialization_error = deserializeJson(json_object, payload);
+  DeserializationError deserialization_error = deserializeJson(json_object, payload, DeserializationOption::Filter(set_filter));
 
   if (deserialization_error) {
     note("Read data error: " + String(deserialization_error.c_str()) + "\n" + payload);
     return;
   }
+  set_memory = max(set_memory, (uint32_t)json_object.memoryUsage());
 
   if (json_object.containsKey("calibrate")) {
     wings = 123;
@@ -636,26 +808,23 @@ void readData(const String& payload, bool per_wifi) {
   bool smart_change = false;
 
   if (json_object.containsKey("ip") && json_object.containsKey("id")) {
-      for (int i = 0; i < devices_count; i++) {
-        if (devices_array[i].ip == json_object["ip"].as<String>()) {
-          devices_array[i].mac = json_object["id"].as<String>();
-        }
-      }
+    setDeviceId(json_object["ip"].as<String>(), json_object["id"].as<String>());
   }
 
   if (json_object.containsKey("offset")) {
-    if (offset != json_object["offset"].as<int>()) {
+    int new_offset = json_object["offset"].as<int>();
+    if (offset != new_offset) {
       if (RTCisrunning() && !json_object.containsKey("time")) {
-        rtc.adjust(DateTime((rtc.now().unixtime() - offset) + json_object["offset"].as<int>()));
+        rtc.adjust(DateTime((rtc.now().unixtime() - offset) + new_offset));
         note("Time zone change");
       }
-      offset = json_object["offset"].as<int>();
+      offset = new_offset;
       settings_change = true;
     }
   }
 
   if (json_object.containsKey("dst")) {
-    if (dst != strContains(json_object["dst"].as<String>(), 1)) {
+    if (dst != getSettingFlag(json_object["dst"])) {
       dst = !dst;
       settings_change = true;
       if (RTCisrunning() && !json_object.containsKey("time")) {
@@ -681,6 +850,7 @@ void readData(const String& payload, bool per_wifi) {
         #endif
         note("RTC begin");
         start_u_time = (millis() / 1000) + rtc.now().unixtime() - offset - (dst ? 3600 : 0);
+        state_generation++;
         if (RTCisrunning()) {
           details_change = true;
         }
@@ -689,8 +859,9 @@ void readData(const String& payload, bool per_wifi) {
   }
 
   if (json_object.containsKey("smart")) {
-    if (getSmartString(true) != json_object["smart"].as<String>()) {
-      setSmart(json_object["smart"].as<String>());
+    String new_smart = json_object["smart"].as<String>();
+    if (getSmartString(true) != new_smart) {
+      setSmart(new_smart);
       settings_change = true;
       if (per_wifi) {
         smart_change = true;
@@ -698,124 +869,25 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
-  if (json_object.containsKey("smart_lock")) {
-    if (smart_lock != strContains(json_object["smart_lock"].as<String>(), 1)) {
-      smart_lock = !smart_lock;
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("location")) {
-    if (geo_location != json_object["location"].as<String>()) {
-      geo_location = json_object["location"].as<String>();
-      if (geo_location.length() > 2) {
-        sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
-      } else {
-        last_sun_check = -1;
-        next_sunset = -1;
-        next_sunrise = -1;
-        sunset_u_time = 0;
-        sunrise_u_time = 0;
-        calendar_twilight = false;
-      }
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("boundary")) {
-    if (boundary != json_object["boundary"].as<int>()) {
-      boundary = json_object["boundary"].as<int>();
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("reversed")) {
-    if (reversed != strContains(json_object["reversed"].as<String>(), 1)) {
-      reversed = !reversed;
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("separately")) {
-    if (separately != strContains(json_object["separately"].as<String>(), 1)) {
-      separately = !separately;
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("inverted")) {
-    if (inverted_sequence != strContains(json_object["inverted"].as<String>(), 1)) {
-      inverted_sequence = !inverted_sequence;
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("tandem")) {
-    if (tandem != strContains(json_object["tandem"].as<String>(), 1)) {
-      tandem = !tandem;
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("fixit")) {
-    if (getFixit() != json_object["fixit"].as<String>()) {
-      if (strContains(json_object["fixit"].as<String>(), ";")) {
-        if (steps[0] > 0) {
-          fixit[0] = json_object["fixit"].as<String>().substring(0, json_object["fixit"].as<String>().indexOf(";")).toInt();
-        }
-        if (steps[1] > 0) {
-          fixit[1] = json_object["fixit"].as<String>().substring(json_object["fixit"].as<String>().indexOf(";") + 1, json_object["fixit"].as<String>().lastIndexOf(";")).toInt();
-        }
-        if (steps[2] > 0) {
-          fixit[2] = json_object["fixit"].as<String>().substring(json_object["fixit"].as<String>().lastIndexOf(";") + 1).toInt();
-        }
-      } else {
-        for (int i = 0; i < 3; i++) {
-          if (steps[i] > 0) {
-            fixit[i] = json_object["fixit"].as<int>();
-          }
-        }
-      }
-      settings_change = true;
-      details_change = true;
-    }
-  }
-
-  if (json_object.containsKey("day_night")) {
-    if (getDayNight() != json_object["day_night"].as<String>()) {
-      if (strContains(json_object["day_night"].as<String>(), ";")) {
-        if (steps[0] > 0) {
-          day_night[0] = json_object["day_night"].as<String>().substring(0, json_object["day_night"].as<String>().indexOf(";")).toInt();
-        }
-        if (steps[1] > 0) {
-          day_night[1] = json_object["day_night"].as<String>().substring(json_object["day_night"].as<String>().indexOf(";") + 1, json_object["day_night"].as<String>().lastIndexOf(";")).toInt();
-        }
-        if (steps[2] > 0) {
-          day_night[2] = json_object["day_night"].as<String>().substring(json_object["day_night"].as<String>().lastIndexOf(";") + 1).toInt();
-        }
-      } else {
-        for (int i = 0; i < 3; i++) {
-          if (steps[i] > 0) {
-            day_night[i] = json_object["day_night"].as<int>();
-          }
+  for (JsonPair pair : json_object.as<JsonObject>()) {
+    for (const Setting& setting : settings_table) {
+      if ((setting.flags & setting_received) && strcmp(pair.key().c_str(), setting.key) == 0) {
+        if (receiveSetting(setting, pair.value())) {
+          settings_change = true;
+          details_change |= (setting.flags & setting_details) > 0;
         }
+        break;
       }
-      settings_change = true;
-      details_change = true;
     }
   }
 
+  char steps_key[] = "steps1";
   for (int i = 0; i < 3; i++) {
-    if (json_object.containsKey("steps" + String(i + 1)) && actual[i] == destination[i] && (!tandem || i == 0)) {
-      if (steps[i] != json_object["steps" + String(i + 1)].as<int>()) {
-        steps[i] = json_object["steps" + String(i + 1)].as<int>();
+    steps_key[5] = '1' + i;
+    if (json_object.containsKey(steps_key) && actual[i] == destination[i] && (!tandem || i == 0)) {
+      int new_steps = json_object[steps_key].as<int>();
+      if (steps[i] != new_steps) {
+        steps[i] = new_steps;
         settings_change = true;
         details_change = true;
       }
@@ -823,7 +895,11 @@ void readData(const String& payload, bool per_wifi) {
   }
 
   if (json_object.containsKey("light") && !has_a_sensor) {
-    if (sensor_twilight != strContains(json_object["light"].as<String>(), "t")) {
+    JsonVariant light = json_object["light"];
+    const char* light_text = light.as<const char*>();
+    bool new_twilight = light_text != nullptr && strchr(light_text, 't') != nullptr;
+    state_generation++;
+    if (sensor_twilight != new_twilight) {
       sensor_twilight = !sensor_twilight;
       twilight_change = true;
       settings_change = true;
@@ -840,39 +916,40 @@ void readData(const String& payload, bool per_wifi) {
         }
       }
     }
-    if (strContains(json_object["light"].as<String>(), "t")) {
-		  light_sensor = json_object["light"].as<String>().substring(0, json_object["light"].as<String>().indexOf("t")).toInt();
-    } else {
-		  light_sensor = json_object["light"].as<int>();
+    light_sensor = light_text != nullptr ? atoi(light_text) : light.as<int>();
+  }
+
+  if (json_object.containsKey("motion")) {
+    String verb = json_object["motion"].as<String>();
+    if (verb == "stop") {
+      stopMotion();
+    }
+    if (verb == "pause") {
+      pauseMotion();
+    }
+    if (verb == "resume") {
+      resumeMotion();
     }
   }
 
+  int new_destination[] = {-1, -1, -1};
   if (json_object.containsKey("val") || json_object.containsKey("blinds")) {
-    String new_value = json_object.containsKey("val") ? json_object["val"].as<String>() : json_object["blinds"].as<String>();
+    int new_value[3];
+    getSettingTriple(json_object.containsKey("val") ? json_object["val"] : json_object["blinds"], new_value);
+    for (int i = 0; i < 3; i++) {
+      if (steps[i] > 0) {
+        new_destination[i] = toSteps(new_value[i], steps[i]);
+      }
+    }
 
     if ((destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2])
     && !settings_change && !details_change && !smart_change && per_wifi && !json_object.containsKey("apk")
-    && (steps[0] == 0 || (steps[0] > 0 && destination[0] == toSteps((strContains(new_value, ";") ? new_value.substring(0, new_value.indexOf(";")).toInt() : new_value.toInt()), steps[0])))
-    && (steps[1] == 0 || (steps[1] > 0 && destination[1] == toSteps((strContains(new_value, ";") ? new_value.substring(new_value.indexOf(";") + 1, new_value.lastIndexOf(";")).toInt() : new_value.toInt()), steps[1])))
-    && (steps[2] == 0 || (steps[2] > 0 && destination[2] == toSteps((strContains(new_value, ";") ? new_value.substring(new_value.lastIndexOf(";") + 1).toInt() : new_value.toInt()), steps[2])))) {
-      for (int i = 0; i < 3; i++) {
-        if (steps[i] > 0 && destination[i] != actual[i]) {
-          destination[i] = actual[i] - 1;
-        }
-      }
-    } else {
-      if (steps[0] > 0) {
-        destination[0] = toSteps((strContains(new_value, ";") ? new_value.substring(0, new_value.indexOf(";")).toInt() : new_value.toInt()), steps[0]);
-      }
-      if (steps[1] > 0) {
-        destination[1] = toSteps((strContains(new_value, ";") ? new_value.substring(new_value.indexOf(";") + 1, new_value.lastIndexOf(";")).toInt() : new_value.toInt()), steps[1]);
-      }
-      if (steps[2] > 0) {
-        destination[2] = toSteps((strContains(new_value, ";") ? new_value.substring(new_value.lastIndexOf(";") + 1).toInt() : new_value.toInt()), steps[2]);
-      }
+    && destination[0] == max(new_destination[0], 0) && destination[1] == max(new_destination[1], 0) && destination[2] == max(new_destination[2], 0)) {
+      stopMotion(); // Repeating the target of a running move means stop.
+      new_destination[0] = new_destination[1] = new_destination[2] = -1;
     }
-    if (destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2]) {
-      if (smart_lock != ((destination[0] == steps[0] && steps[0] > 0) || (destination[1] == steps[1] && steps[1] > 0) || (destination[2] == steps[2] && steps[2] > 0))) {
+    if ((new_destination[0] > -1 && new_destination[0] != actual[0]) || (new_destination[1] > -1 && new_destination[1] != actual[1]) || (new_destination[2] > -1 && new_destination[2] != actual[2])) {
+      if (smart_lock != ((new_destination[0] == steps[0] && steps[0] > 0) || (new_destination[1] == steps[1] && steps[1] > 0) || (new_destination[2] == steps[2] && steps[2] > 0))) {
         smart_lock = !smart_lock;
         settings_change = true;
         details_change = true;
@@ -880,6 +957,8 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
+  profile(profile_set, start_us);
+
   if (settings_change) {
     note("Received the data:\n " + payload);
     saveSettings();
@@ -890,10 +969,8 @@ void readData(const String& payload, bool per_wifi) {
   if (json_object.containsKey("location") && RTCisrunning()) {
     getSunriseSunset(rtc.now());
   }
-  if (json_object.containsKey("val") || json_object.containsKey("blinds")) {
-    if (destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2]) {
-      prepareRotation(per_wifi ? (json_object.containsKey("apk") ? "apk" : "local") : "cloud");
-    }
+  if (new_destination[0] > -1 || new_destination[1] > -1 || new_destination[2] > -1) {
+    queueMotion(new_destination, per_peer ? "peer" : (per_wifi ? (json_object.containsKey("apk") ? "apk" : "local") : "cloud"));
   }
 }
 
@@ -907,10 +984,13 @@ void automation() {
   int current_time = (now.hour() * 60) + now.minute();
 
   if (now.second() == 0) {
+    if (now.minute() == 0) {
+      announce(announce_time);
+    }
     if (current_time == 60) {
-      ntpClient.update();
-      readData("{\"time\":" + String(ntpClient.getEpochTime()) + "}", false);
+      requestTime();
 
+      state_generation++;
       if (last_accessed_log++ > 14) {
         deactivationTheLog();
       }
@@ -1037,7 +1117,9 @@ int hasTheLightChanged() {
       saveSettings();
     }
     if (result) {
-      putMultiOfflineData("{\"light\":\"" + getSensorDetail(true) + "\"}", false);
+      state_generation++;
+      announce(announce_light | announce_twilight);
+      putMultiOfflineData("{\"light\":\"" + getSensorDetail(true) + "\"}", false); // Peers that announce themselves are skipped.
     }
   }
 
@@ -1130,6 +1212,7 @@ void initiateTheLightSensor() {
     has_a_sensor = true;
     light_sensor = boundary;
     sensor_twilight = calendar_twilight;
+    state_generation++;
   }
   server.send(200, "text/plain", "Done");
 }
@@ -1169,6 +1252,12 @@ void makeMeasurement() {
     }
   }
 
+  measurement_wings = 0;
+  for (int i = 0; i < 3; i++) {
+    if (strContains(wings, i + 1)) {
+      measurement_wings |= 1 << i;
+    }
+  }
   measurement = true;
   digitalWrite(bipolar_direction_pin, !reversed);
 
@@ -1181,6 +1270,7 @@ void cancelMeasurement() {
   }
 
   measurement = false;
+  stopStepper();
   setStepperOff();
   wings = 0;
 
@@ -1193,6 +1283,7 @@ void endMeasurement() {
   }
 
   measurement = false;
+  stopStepper();
   setStepperOff();
 
   for (int i = 0; i < 3; i++) {
@@ -1217,19 +1308,171 @@ void setStepperOff() {
   digitalWrite(bipolar_step_pin, LOW);
 }
 
+void startStepper() {
+  if (stepping) {
+    if (measurement_stepping == measurement) {
+      return;
+    }
+    stopStepper(); // A measurement started or ended during a move, so the other routine is attached below.
+  }
+
+  if (first_step_millis == 0) {
+    first_step_millis = millis();
+  }
+  stepping = true;
+  step_counter = 0;
+  step_mask = 0;
+  measurement_stepping = measurement;
+  timer1_attachInterrupt(measurement ? measurementRotation : rotation);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+  timer1_write(step_interval * timer_ticks);
+}
+
+void stopStepper() {
+  if (!stepping) {
+    return;
+  }
+
+  timer1_disable();
+  timer1_detachInterrupt();
+  stepping = false;
+}
+
+uint8_t getOrigin(const String& orderer) {
+  if (orderer == "smart") {
+    return origin_smart;
+  }
+  return orderer == "peer" ? origin_peer : origin_manual; // Cloud orders come from a user too.
+}
+
+void queueMotion(const int new_destination[3], const String& orderer) {
+  MotionCommand& command = motion_queue[getOrigin(orderer)];
+  for (int i = 0; i < 3; i++) {
+    if (new_destination[i] > -1 && steps[i] > 0) {
+      command.destination[i] = new_destination[i];
+    } else {
+      if (!command.pending) {
+        command.destination[i] = -1;
+      }
+    }
+  }
+  command.pending = true;
+  command.updated_millis = millis();
+  command.orderer = orderer;
+  state_generation++;
+}
+
+void dispatchMotion() {
+  bool moving = destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2];
+  if (!moving) {
+    for (int origin = 0; origin < motion_origin; origin++) { // Lower commands that waited for the move don't undo it.
+      for (int i = 0; i < 3; i++) {
+        if (motion_wings & (1 << i)) {
+          motion_queue[origin].destination[i] = -1;
+        }
+      }
+      motion_queue[origin].pending &= motion_queue[origin].destination[0] > -1 || motion_queue[origin].destination[1] > -1 || motion_queue[origin].destination[2] > -1;
+    }
+    motion_origin = -1;
+  }
+  if (motion_paused) {
+    return;
+  }
+
+  for (int origin = origins - 1; origin >= 0; origin--) {
+    MotionCommand& command = motion_queue[origin];
+    if (!command.pending) {
+      continue;
+    }
+    if ((moving && origin < motion_origin) || millis() - command.updated_millis < motion_window) {
+      return;
+    }
+
+    command.pending = false;
+    uint8_t wings = 0;
+    for (int i = 0; i < 3; i++) {
+      if (command.destination[i] > -1) {
+        destination[i] = command.destination[i];
+        wings |= 1 << i;
+      }
+    }
+    if (destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2]) {
+      motion_wings = origin == motion_origin ? motion_wings | wings : wings;
+      motion_origin = origin;
+      prepareRotation(command.orderer);
+    }
+    return;
+  }
+}
+
+int getMotionQueue() {
+  int count = 0;
+  for (int origin = 0; origin < origins; origin++) {
+    if (motion_queue[origin].pending) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void stopMotion() {
+  for (int origin = 0; origin < origins; origin++) {
+    motion_queue[origin].pending = false;
+  }
+  for (int i = 0; i < 3; i++) {
+    destination[i] = actual[i];
+  }
+  motion_paused = false;
+  state_generation++;
+  note("Movement stopped");
+}
+
+void pauseMotion() {
+  if (motion_paused) {
+    return;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    paused_destination[i] = destination[i];
+    destination[i] = actual[i];
+  }
+  motion_paused = true;
+  state_generation++;
+  note("Movement paused");
+}
+
+void resumeMotion() {
+  if (!motion_paused) {
+    return;
+  }
+
+  motion_paused = false;
+  for (int i = 0; i < 3; i++) {
+    destination[i] = paused_destination[i];
+  }
+  if (destination[0] != actual[0] || destination[1] != actual[1] || destination[2] != actual[2]) {
+    prepareRotation("resume");
+  }
+}
+
 void prepareRotation(String orderer) {
+  state_generation++;
   String log_text = "";
+  bool settings_change = false;
 
   for (int i = 0; i < 3; i++) {
     if (steps[i] > 0 && destination[i] != actual[i] && (!tandem || i == 0)) {
       if (actual[i] == steps[i] && destination[i] == 0) {
         if (fixit[i] != 0) {
+          noInterrupts(); // The wing may already be stepping from timer1.
           actual[i] += fixit[i];
+          interrupts();
         }
         cycles[i]++;
         if (tandem) {
           cycles[1]++;
         }
+        settings_change = true;
       }
       log_text += "\n " + (tandem ? "tandem" : String(i + 1)) + " by " + String(destination[i] - actual[i]) + " steps to " + toPercentages(destination[i], steps[i]) + "%";
     }
@@ -1238,7 +1481,9 @@ void prepareRotation(String orderer) {
   if (log_text.length() > 0) {
     note("Movement (" + orderer + "): " + log_text);
     saveTheState();
-    saveSettings();
+    if (settings_change) {
+      saveSettings();
+    }
   }
 }
 
@@ -1276,9 +1521,9 @@ void calibration(int set, bool positioning) {
   }
 }
 
-void measurementRotation() {
+void IRAM_ATTR measurementRotation() {
   for (int i = 0; i < 3; i++) {
-    if (strContains(wings, i + 1) && (!tandem || i == 0)) {
+    if ((measurement_wings & (1 << i)) && (!tandem || i == 0)) {
       digitalWrite(bipolar_enable_pin[i], LOW);
       if (tandem) {
         digitalWrite(bipolar_enable_pin[1], LOW);
@@ -1289,61 +1534,85 @@ void measurementRotation() {
 
   digitalWrite(bipolar_step_pin, HIGH);
   digitalWrite(bipolar_step_pin, LOW);
-  delay(4);
 }
 
-void rotation() {
-  if (destination[0] != actual[0] && (!inverted_sequence ||
-    ((destination[1] == actual[1] || (!separately && ((destination[1] > actual[1] && destination[0] > actual[0]) || (destination[1] < actual[1] && destination[0] < actual[0])))) &&
-    (destination[2] == actual[2] || (!separately && ((destination[2] > actual[2] && destination[0] > actual[0]) || (destination[2] < actual[2] && destination[0] < actual[0]))))))) {
-    digitalWrite(bipolar_direction_pin, destination[0] < actual[0] ? reversed : !reversed);
-    digitalWrite(bipolar_enable_pin[0], LOW);
-    if (tandem) {
-      digitalWrite(bipolar_enable_pin[1], LOW);
-    }
-    if (destination[0] > actual[0]) {
-      actual[0]++;
-    } else {
-      actual[0]--;
-    }
-  } else {
-    digitalWrite(bipolar_enable_pin[0], HIGH);
-    if (tandem) {
-      digitalWrite(bipolar_enable_pin[1], HIGH);
-    }
+void IRAM_ATTR rotation() {
+  uint32_t start_us = micros();
+  uint8_t mask = planRotation();
+
+  digitalWrite(bipolar_direction_pin, mask & 0x38 ? reversed : !reversed);
+  for (int i = 0; i < 3; i++) {
+    digitalWrite(bipolar_enable_pin[i], (mask & (1 << i)) || (tandem && i == 1 && (mask & 1)) ? LOW : HIGH);
+  }
+  if (mask != 0) {
+    digitalWrite(bipolar_step_pin, HIGH);
+    digitalWrite(bipolar_step_pin, LOW);
   }
 
-  if (!tandem) {
-    if (destination[1] != actual[1] && (inverted_sequence ?
-      (destination[2] == actual[2] || (!separately && ((destination[2] > actual[2] && destination[1] > actual[1]) || (destination[2] < actual[2] && destination[1] < actual[1])))) :
-      (destination[0] == actual[0] || (!separately && ((destination[0] > actual[0] && destination[1] > actual[1]) || (destination[0] < actual[0] && destination[1] < actual[1])))))) {
-      digitalWrite(bipolar_direction_pin, destination[1] < actual[1] ? reversed : !reversed);
-      digitalWrite(bipolar_enable_pin[1], LOW);
-      if (destination[1] > actual[1]) {
-        actual[1]++;
+  for (int i = 0; i < 3; i++) {
+    if (mask & (1 << i)) {
+      if (mask & (8 << i)) {
+        actual[i]--;
       } else {
-        actual[1]--;
+        actual[i]++;
       }
-    } else {
-      digitalWrite(bipolar_enable_pin[1], HIGH);
     }
+  }
 
-    if (destination[2] != actual[2] && (inverted_sequence ||
-      ((destination[0] == actual[0] || (!separately && ((destination[0] > actual[0] && destination[2] > actual[2]) || (destination[0] < actual[0] && destination[2] < actual[2])))) &&
-      (destination[1] == actual[1] || (!separately && ((destination[1] > actual[1] && destination[2] > actual[2]) || (destination[1] < actual[1] && destination[2] < actual[2]))))))) {
-      digitalWrite(bipolar_direction_pin, destination[2] < actual[2] ? reversed : !reversed);
-      digitalWrite(bipolar_enable_pin[2], LOW);
-      if (destination[2] > actual[2]) {
-        actual[2]++;
-      } else {
-        actual[2]--;
+  setStepInterval(mask);
+  profile(profile_rotation, start_us);
+}
+
+uint8_t IRAM_ATTR planRotation() { // Bits 0-2 wings to step, bits 3-5 wings to step down.
+  uint8_t mask = 0;
+  bool down;
+  int wing;
+
+  for (int pass = 0; pass < 2 && mask == 0; pass++) { // The direction of the last step goes on while a wing still needs it.
+    down = step_mask & 0x38;
+    for (int i = 0; i < 3; i++) {
+      wing = inverted_sequence ? 2 - i : i;
+      if (destination[wing] != actual[wing] && (!tandem || wing == 0)) {
+        if (mask == 0 && (pass == 1 || (step_mask & 7) == 0)) {
+          down = destination[wing] < actual[wing];
+        }
+        if ((destination[wing] < actual[wing]) != down) {
+          continue; // The drivers count every pulse on the shared STEP and DIR lines, even when disabled, so the other direction waits.
+        }
+        mask |= 1 << wing;
+        if (down) {
+          mask |= 8 << wing;
+        }
+        if (separately) {
+          break;
+        }
       }
-    } else {
-      digitalWrite(bipolar_enable_pin[2], HIGH);
     }
   }
 
-  digitalWrite(bipolar_step_pin, HIGH);
-  digitalWrite(bipolar_step_pin, LOW);
-  delay(4);
+  return mask;
+}
+
+void IRAM_ATTR setStepInterval(uint8_t mask) { // Bits 0-2 wings stepped, bits 3-5 wings stepped down.
+  if ((mask & ~step_mask & 7) || ((mask ^ step_mask) & (mask & step_mask & 7) << 3)) { // A wing starts or reverses.
+    step_counter = 0;
+  }
+  step_mask = mask;
+
+  if (acceleration == 0 || cruise >= step_interval) {
+    timer1_write(cruise * timer_ticks); // Settings may change during a move.
+    return;
+  }
+
+  int remaining = 0;
+  for (int i = 0; i < 3; i++) {
+    if (mask & (1 << i)) {
+      remaining = max(remaining, abs(destination[i] - actual[i]));
+    }
+  }
+
+  int ramp = min((int)step_counter, remaining);
+  step_counter++;
+  int interval = ramp < acceleration ? step_interval - (step_interval - cruise) * ramp / acceleration : cruise;
+  timer1_write(interval * timer_ticks);
 }
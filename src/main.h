@@ -24,11 +24,58 @@ int cycles[] = {0, 0, 0};
 int day_night[] = {0, 0, 0};
 
 int steps[] = {0, 0, 0};
-int destination[] = {0, 0, 0};
-int actual[] = {0, 0, 0};
+volatile int destination[] = {0, 0, 0};
+volatile int actual[] = {0, 0, 0};
+
+const int step_interval = 4000; // Microseconds per step when starting.
+const int timer_ticks = 5; // Ticks of timer1 per microsecond.
+const int default_cruise = step_interval;
+int acceleration = 0;
+int cruise = default_cruise;
+volatile bool stepping = false;
+bool measurement_stepping = false; // Routine attached to timer1: measurementRotation or rotation.
+volatile int step_counter = 0;
+volatile uint8_t step_mask = 0;
+
+struct JournalRecord {
+  uint32_t sequence;
+  int32_t actual[3];
+  int32_t destination[3];
+  uint32_t crc;
+};
+const int journal_records = 64; // Records per journal file before switching to the other one.
+uint32_t journal_sequence = 0;
+uint8_t journal_file = 0;
+int journal_count = 0;
+
+const uint8_t origin_peer = 0;
+const uint8_t origin_smart = 1;
+const uint8_t origin_manual = 2; // Higher origins go first and are not overridden by lower ones.
+const uint8_t origins = 3;
+const uint32_t motion_window = 250; // Milliseconds a command waits for newer ones from the same origin.
+struct MotionCommand {
+  int destination[3]; // -1 leaves the wing alone.
+  bool pending;
+  uint32_t updated_millis;
+  String orderer;
+};
+MotionCommand motion_queue[origins]; // One slot per origin, newer commands coalesce into it.
+int motion_origin = -1; // Origin of the running move.
+uint8_t motion_wings = 0; // Wings the running move set, a bit per wing.
+bool motion_paused = false;
+int paused_destination[] = {-1, -1, -1};
+
+const int max_event_clients = 3;
+WiFiClient event_clients[max_event_clients];
+int event_destination[] = {-1, -1, -1};
+int event_actual[] = {-1, -1, -1};
+int event_light = -1;
+bool event_twilight[] = {false, false}; // Sensor and calendar twilight last pushed.
+uint32_t event_millis = 0;
 
 bool measurement = false;
 int wings = 123;
+uint8_t measurement_wings = 0;
 
 bool has_a_sensor = false;
 uint32_t dusk_u_time = 0;
@@ -39,12 +86,18 @@ int twilight_counter = 0;
 bool block_twilight_counter = false;
 
 String toPercentages(int value, int steps);
+int toPercent(int value, int steps);
 int toSteps(int value, int steps);
+void limitAcceleration();
+void limitCruise();
+void buildSetFilter();
 bool readSettings(bool backup);
 void saveSettings();
 void saveSettings(bool log);
+void writeSettings(bool log);
 void resume();
 void saveTheState();
+void clearJournal();
 String getFixit();
 String getFixit(String separator);
 String getCycles();
@@ -58,12 +111,19 @@ String getValue(String separator);
 int getValue(int number);
 String getActual();
 String getActual(bool complete);
+int getActual(int number);
 String getSensorDetail(bool basic);
 void startServices();
 void handshake();
+void getHello(bool per_rest_client);
 void requestForState();
+String getState();
+void requestForEvents();
+void pushEvents();
 void exchangeOfBasicData();
+String getBasicData();
 void readData(const String& payload, bool per_wifi);
+void readData(const String& payload, bool per_wifi, bool per_peer);
 void automation();
 int hasTheLightChanged();
 void smartAction();
@@ -76,7 +136,18 @@ void makeMeasurement();
 void cancelMeasurement();
 void endMeasurement();
 void setStepperOff();
+void startStepper();
+void stopStepper();
+void setStepInterval(uint8_t mask);
+uint8_t getOrigin(const String& orderer);
+void queueMotion(const int new_destination[3], const String& orderer);
+void dispatchMotion();
+int getMotionQueue();
+void stopMotion();
+void pauseMotion();
+void resumeMotion();
 void prepareRotation(String orderer);
 void calibration(int set, bool positioning);
 void measurementRotation();
 void rotation();
+uint8_t planRotation();
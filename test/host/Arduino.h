@@ -0,0 +1,265 @@
+// Host stand-in for the ESP8266 Arduino core: String, Print/Stream, GPIO, timer1 and a virtual clock.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+#define ARDUINO 10819
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+#define PSTR(x) x
+#define F(x) x
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+enum { D0 = 16, D1 = 5, D2 = 4, D3 = 0, D4 = 2, D5 = 14, D6 = 12, D7 = 13, D8 = 15, A0 = 17 };
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class String {
+  public:
+    String() {}
+    String(const char* text) : s(text != nullptr ? text : "") {}
+    String(const std::string& text) : s(text) {}
+    explicit String(char c) : s(1, c) {}
+    String(int value) : s(std::to_string(value)) {}
+    String(unsigned value) : s(std::to_string(value)) {}
+    String(long value) : s(std::to_string(value)) {}
+    String(unsigned long value) : s(std::to_string(value)) {}
+    String(long long value) : s(std::to_string(value)) {}
+    String(unsigned long long value) : s(std::to_string(value)) {}
+    String(float value, unsigned char decimals = 2) : String((double)value, decimals) {}
+    String(double value, unsigned char decimals = 2) {
+      char buffer[48];
+      snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+      s = buffer;
+    }
+
+    unsigned length() const { return s.size(); }
+    const char* c_str() const { return s.c_str(); }
+    char charAt(unsigned index) const { return index < s.size() ? s[index] : 0; }
+    char operator[](unsigned index) const { return charAt(index); }
+    bool reserve(unsigned size) { s.reserve(size); return true; }
+
+    int indexOf(char c, unsigned from = 0) const { return position(s.find(c, from)); }
+    int indexOf(const String& text, unsigned from = 0) const { return position(s.find(text.s, from)); }
+    int lastIndexOf(char c) const { return position(s.rfind(c)); }
+    int lastIndexOf(const String& text) const { return position(s.rfind(text.s)); }
+    bool startsWith(const String& text) const { return s.compare(0, text.s.size(), text.s) == 0; }
+    bool endsWith(const String& text) const { return s.size() >= text.s.size() && s.compare(s.size() - text.s.size(), text.s.size(), text.s) == 0; }
+
+    String substring(unsigned from) const { return from < s.size() ? String(s.substr(from)) : String(); }
+    String substring(unsigned from, unsigned to) const {
+      if (from > to) {
+        std::swap(from, to);
+      }
+      return from < s.size() ? String(s.substr(from, to - from)) : String();
+    }
+    void replace(const String& from, const String& to) {
+      if (from.s.empty()) {
+        return;
+      }
+      for (size_t p = s.find(from.s); p != std::string::npos; p = s.find(from.s, p + to.s.size())) {
+        s.replace(p, from.s.size(), to.s);
+      }
+    }
+    void remove(unsigned index) { if (index < s.size()) s.erase(index); }
+    void remove(unsigned index, unsigned count) { if (index < s.size()) s.erase(index, count); }
+    void trim() {
+      size_t first = s.find_first_not_of(" \t\r\n");
+      size_t last = s.find_last_not_of(" \t\r\n");
+      s = first == std::string::npos ? "" : s.substr(first, last - first + 1);
+    }
+    const char* begin() const { return s.data(); }
+    const char* end() const { return s.data() + s.size(); }
+    void toCharArray(char* buffer, unsigned size) const {
+      if (size > 0) {
+        strncpy(buffer, s.c_str(), size - 1);
+        buffer[size - 1] = 0;
+      }
+    }
+
+    long toInt() const { return atol(s.c_str()); }
+    float toFloat() const { return atof(s.c_str()); }
+    double toDouble() const { return atof(s.c_str()); }
+
+    bool concat(const String& text) { s += text.s; return true; }
+    bool concat(const char* text, unsigned length) { s.append(text, length); return true; }
+    bool concat(char c) { s += c; return true; }
+    String& operator+=(const String& text) { s += text.s; return *this; }
+    String& operator+=(const char* text) { s += text; return *this; }
+    String& operator+=(char c) { s += c; return *this; }
+    String& operator+=(int value) { s += std::to_string(value); return *this; }
+    String& operator+=(unsigned value) { s += std::to_string(value); return *this; }
+    String& operator+=(long value) { s += std::to_string(value); return *this; }
+    String& operator+=(unsigned long value) { s += std::to_string(value); return *this; }
+
+    bool operator==(const String& text) const { return s == text.s; }
+    bool operator!=(const String& text) const { return s != text.s; }
+    bool operator==(const char* text) const { return s == text; }
+    bool operator!=(const char* text) const { return s != text; }
+    bool operator<(const String& text) const { return s < text.s; }
+    bool operator>(const String& text) const { return s > text.s; }
+
+    std::string s;
+
+  private:
+    static int position(size_t p) { return p == std::string::npos ? -1 : (int)p; }
+};
+
+inline String operator+(const String& a, const String& b) { return String(a.s + b.s); }
+inline String operator+(const String& a, const char* b) { return String(a.s + b); }
+inline String operator+(const char* a, const String& b) { return String(a + b.s); }
+inline String operator+(const String& a, char b) { return String(a.s + b); }
+inline String operator+(const String& a, int b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, unsigned b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, long b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, unsigned long b) { return String(a.s + std::to_string(b)); }
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      for (size_t i = 0; i < size; i++) {
+        write(buffer[i]);
+      }
+      return size;
+    }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    size_t write(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+    virtual void flush() {}
+
+    size_t print(const String& text) { return write((const uint8_t*)text.c_str(), text.length()); }
+    size_t print(const char* text) { return write(text); }
+    size_t print(char c) { return write((uint8_t)c); }
+    template <typename T> size_t print(T value) { return print(String(value)); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    size_t println() { return write("\r\n"); }
+    size_t printf(const char* format, ...) {
+      char buffer[256];
+      va_list arguments;
+      va_start(arguments, format);
+      int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+      va_end(arguments);
+      return write((const uint8_t*)buffer, std::min(length, (int)sizeof(buffer) - 1));
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    size_t write(uint8_t) override { return 1; }
+    using Print::write;
+
+    void setTimeout(unsigned long) {}
+    size_t readBytes(char* buffer, size_t size) {
+      size_t count = 0;
+      for (int c; count < size && (c = read()) >= 0; count++) {
+        buffer[count] = c;
+      }
+      return count;
+    }
+    size_t readBytes(uint8_t* buffer, size_t size) { return readBytes((char*)buffer, size); }
+    String readString() {
+      String text;
+      for (int c; (c = read()) >= 0;) {
+        text += (char)c;
+      }
+      return text;
+    }
+    String readStringUntil(char terminator) {
+      String text;
+      for (int c; (c = read()) >= 0 && c != terminator;) {
+        text += (char)c;
+      }
+      return text;
+    }
+};
+
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c) override;
+    using Print::write;
+    explicit operator bool() const { return true; }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+  public:
+    uint32_t getFreeHeap() { return 40000; }
+    uint32_t getMaxFreeBlockSize() { return 30000; }
+    uint32_t getCycleCount();
+    void restart() {}
+};
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void noInterrupts();
+void interrupts();
+
+#define TIM_DIV1 0
+#define TIM_DIV16 1
+#define TIM_DIV256 3
+#define TIM_EDGE 0
+#define TIM_LEVEL 1
+#define TIM_SINGLE 0
+#define TIM_LOOP 1
+typedef void (*timercallback)(void);
+void timer1_attachInterrupt(timercallback routine);
+void timer1_detachInterrupt();
+void timer1_enable(uint8_t divider, uint8_t interrupt_type, uint8_t reload);
+void timer1_disable();
+void timer1_write(uint32_t ticks);
+
+inline bool isDigit(int c) { return c >= '0' && c <= '9'; }
+using std::min;
+using std::max;
+#define constrain(value, low, high) ((value) < (low) ? (low) : ((value) > (high) ? (high) : (value)))
+
+class IPAddress {
+  public:
+    IPAddress() : address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    IPAddress(uint32_t address) : address(address) {}
+    uint8_t operator[](int index) const { return address >> (8 * index); }
+    operator uint32_t() const { return address; }
+    bool isSet() const { return address != 0; }
+    String toString() const {
+      char buffer[16];
+      snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+      return buffer;
+    }
+    bool fromString(const String& text) {
+      unsigned a, b, c, d;
+      if (sscanf(text.c_str(), "%u.%u.%u.%u", &a, &b, &c, &d) != 4) {
+        return false;
+      }
+      *this = IPAddress(a, b, c, d);
+      return true;
+    }
+
+  private:
+    uint32_t address;
+};
@@ -0,0 +1,327 @@
+// Host stand-in for the part of ArduinoJson 6 the firmware uses. Values live in a tree owned by
+// the document; a JsonVariant is a path into it, so reading a missing member never creates it.
+#pragma once
+#include <memory>
+#include "Arduino.h"
+
+#define ARDUINOJSON_VERSION "6.host"
+#define JSON_OBJECT_SIZE(n) ((n) * 16)
+#define JSON_ARRAY_SIZE(n) ((n) * 16)
+
+struct JsonNode {
+  enum Type { null, boolean, integer, real, text, array, object };
+  Type type = null;
+  long long integer_value = 0;
+  double real_value = 0;
+  std::string text_value;
+  std::vector<std::string> keys; // Members of an object, in insertion order, or empty for an array.
+  std::vector<JsonNode> items;
+
+  JsonNode* member(const std::string& key) {
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] == key) {
+        return &items[i];
+      }
+    }
+    return nullptr;
+  }
+  size_t count() const;
+};
+
+inline size_t JsonNode::count() const {
+  size_t nodes = 1;
+  for (const JsonNode& item : items) {
+    nodes += item.count();
+  }
+  return nodes;
+}
+
+class JsonString {
+  public:
+    JsonString(const std::string& text) : text(text) {}
+    const char* c_str() const { return text.c_str(); }
+    operator String() const { return text; }
+
+  private:
+    std::string text;
+};
+
+class JsonPair;
+class JsonPairIterator;
+
+class JsonVariant {
+  public:
+    JsonVariant() : root(nullptr) {}
+    JsonVariant(JsonNode* root) : root(root) {}
+
+    JsonVariant operator[](const char* key) const { return step(Step{key, -1}); }
+    JsonVariant operator[](const String& key) const { return step(Step{key.s, -1}); }
+    JsonVariant operator[](const JsonString& key) const { return step(Step{key.c_str(), -1}); }
+    JsonVariant operator[](int index) const { return step(Step{"", index}); }
+
+    bool isNull() const { const JsonNode* node = find(); return node == nullptr || node->type == JsonNode::null; }
+    size_t size() const { const JsonNode* node = find(); return node != nullptr && node->type >= JsonNode::array ? node->items.size() : 0; }
+    template <typename K> bool containsKey(const K& key) const {
+      const JsonNode* node = find();
+      return node != nullptr && node->type == JsonNode::object && const_cast<JsonNode*>(node)->member(String(key).s) != nullptr;
+    }
+    template <typename K> void remove(const K& key) {
+      JsonNode* node = find();
+      if (node == nullptr || node->type != JsonNode::object) {
+        return;
+      }
+      for (size_t i = 0; i < node->keys.size(); i++) {
+        if (node->keys[i] == String(key).s) {
+          node->keys.erase(node->keys.begin() + i);
+          node->items.erase(node->items.begin() + i);
+          return;
+        }
+      }
+    }
+
+    template <typename T> T as() const;
+    template <typename T> bool is() const;
+
+    JsonVariant& operator=(const JsonVariant& value) {
+      if (root == nullptr) { // An unbound variant takes the other one's place.
+        root = value.root;
+        path = value.path;
+        return *this;
+      }
+      JsonNode copy = value.find() != nullptr ? *value.find() : JsonNode();
+      *create() = copy;
+      return *this;
+    }
+    JsonVariant& operator=(bool value) { JsonNode* node = reset(JsonNode::boolean); node->integer_value = value; return *this; }
+    JsonVariant& operator=(int value) { return setInteger(value); }
+    JsonVariant& operator=(unsigned value) { return setInteger(value); }
+    JsonVariant& operator=(long value) { return setInteger(value); }
+    JsonVariant& operator=(unsigned long value) { return setInteger(value); }
+    JsonVariant& operator=(double value) { JsonNode* node = reset(JsonNode::real); node->real_value = value; return *this; }
+    JsonVariant& operator=(const char* value) { JsonNode* node = reset(JsonNode::text); node->text_value = value; return *this; }
+    JsonVariant& operator=(const String& value) { return *this = value.c_str(); }
+
+    JsonPairIterator begin() const;
+    JsonPairIterator end() const;
+
+    JsonNode* find() const {
+      JsonNode* node = root;
+      for (size_t i = 0; i < path.size() && node != nullptr; i++) {
+        if (path[i].index < 0) {
+          node = node->type == JsonNode::object ? node->member(path[i].key) : nullptr;
+        } else {
+          node = node->type == JsonNode::array && path[i].index < (int)node->items.size() ? &node->items[path[i].index] : nullptr;
+        }
+      }
+      return node;
+    }
+
+  protected:
+    struct Step {
+      std::string key;
+      int index;
+    };
+
+    JsonVariant step(const Step& next) const {
+      JsonVariant variant(root);
+      variant.path = path;
+      variant.path.push_back(next);
+      return variant;
+    }
+    JsonNode* create() {
+      JsonNode* node = root;
+      for (const Step& next : path) {
+        if (next.index < 0) {
+          if (node->type != JsonNode::object) {
+            *node = JsonNode();
+            node->type = JsonNode::object;
+          }
+          JsonNode* child = node->member(next.key);
+          if (child == nullptr) {
+            node->keys.push_back(next.key);
+            node->items.emplace_back();
+            child = &node->items.back();
+          }
+          node = child;
+        } else {
+          if (node->type != JsonNode::array) {
+            *node = JsonNode();
+            node->type = JsonNode::array;
+          }
+          if ((int)node->items.size() <= next.index) {
+            node->items.resize(next.index + 1);
+          }
+          node = &node->items[next.index];
+        }
+      }
+      return node;
+    }
+    JsonNode* reset(JsonNode::Type type) {
+      JsonNode* node = create();
+      *node = JsonNode();
+      node->type = type;
+      return node;
+    }
+    JsonVariant& setInteger(long long value) {
+      JsonNode* node = reset(JsonNode::integer);
+      node->integer_value = value;
+      return *this;
+    }
+
+    JsonNode* root;
+    std::vector<Step> path;
+};
+
+typedef JsonVariant JsonObject;
+typedef JsonVariant JsonArray;
+typedef JsonVariant JsonVariantConst;
+
+class JsonPair {
+  public:
+    JsonPair(const std::string& key, const JsonVariant& value) : key_(key), value_(value) {}
+    JsonString key() const { return key_; }
+    JsonVariant value() const { return value_; }
+
+  private:
+    std::string key_;
+    JsonVariant value_;
+};
+
+class JsonPairIterator {
+  public:
+    JsonPairIterator(const JsonVariant& object, size_t index) : object(object), index(index) {}
+    JsonPair operator*() const { return JsonPair(object.find()->keys[index], object[object.find()->keys[index].c_str()]); }
+    JsonPairIterator& operator++() { index++; return *this; }
+    bool operator!=(const JsonPairIterator& other) const { return index != other.index; }
+
+  private:
+    JsonVariant object;
+    size_t index;
+};
+
+inline JsonPairIterator JsonVariant::begin() const { return JsonPairIterator(*this, 0); }
+inline JsonPairIterator JsonVariant::end() const {
+  const JsonNode* node = find();
+  return JsonPairIterator(*this, node != nullptr && node->type == JsonNode::object ? node->keys.size() : 0);
+}
+
+size_t serializeJsonNode(const JsonNode& node, std::string& output);
+
+template <> inline long long JsonVariant::as<long long>() const {
+  const JsonNode* node = find();
+  if (node == nullptr) {
+    return 0;
+  }
+  if (node->type == JsonNode::integer || node->type == JsonNode::boolean) {
+    return node->integer_value;
+  }
+  if (node->type == JsonNode::real) {
+    return (long long)node->real_value;
+  }
+  return node->type == JsonNode::text ? atoll(node->text_value.c_str()) : 0;
+}
+template <> inline int JsonVariant::as<int>() const { return as<long long>(); }
+template <> inline long JsonVariant::as<long>() const { return as<long long>(); }
+template <> inline unsigned JsonVariant::as<unsigned>() const { return as<long long>(); }
+template <> inline unsigned long JsonVariant::as<unsigned long>() const { return as<long long>(); }
+template <> inline bool JsonVariant::as<bool>() const { return as<long long>() != 0; }
+template <> inline float JsonVariant::as<float>() const {
+  const JsonNode* node = find();
+  return node != nullptr && node->type == JsonNode::real ? node->real_value : as<long long>();
+}
+template <> inline const char* JsonVariant::as<const char*>() const {
+  const JsonNode* node = find();
+  return node != nullptr && node->type == JsonNode::text ? node->text_value.c_str() : nullptr;
+}
+template <> inline String JsonVariant::as<String>() const {
+  const JsonNode* node = find();
+  if (node == nullptr || node->type == JsonNode::text) {
+    return node == nullptr ? "null" : node->text_value;
+  }
+  std::string text;
+  serializeJsonNode(*node, text);
+  return text;
+}
+template <> inline JsonVariant JsonVariant::as<JsonVariant>() const { return *this; }
+
+template <> inline bool JsonVariant::is<const char*>() const { const JsonNode* node = find(); return node != nullptr && node->type == JsonNode::text; }
+template <> inline bool JsonVariant::is<String>() const { return is<const char*>(); }
+template <> inline bool JsonVariant::is<int>() const { const JsonNode* node = find(); return node != nullptr && node->type == JsonNode::integer; }
+template <> inline bool JsonVariant::is<bool>() const { const JsonNode* node = find(); return node != nullptr && node->type == JsonNode::boolean; }
+
+class JsonDocument : public JsonVariant {
+  public:
+    JsonDocument() : JsonVariant(&tree) {}
+    JsonDocument(const JsonDocument& other) : JsonVariant(&tree), tree(other.tree) {}
+    JsonDocument& operator=(const JsonDocument& other) { tree = other.tree; return *this; }
+    using JsonVariant::operator=;
+
+    void clear() { tree = JsonNode(); }
+    size_t memoryUsage() const { return tree.type == JsonNode::null ? 0 : tree.count() * 16; }
+    JsonNode tree;
+};
+
+class DynamicJsonDocument : public JsonDocument {
+  public:
+    DynamicJsonDocument(size_t capacity) : capacity_(capacity) {}
+    using JsonDocument::operator=;
+    size_t capacity() const { return capacity_; }
+
+  private:
+    size_t capacity_;
+};
+
+template <size_t capacity> class StaticJsonDocument : public JsonDocument {
+  public:
+    using JsonDocument::operator=;
+};
+
+class DeserializationError {
+  public:
+    enum Code { Ok, EmptyInput, IncompleteInput, InvalidInput, NoMemory };
+    DeserializationError(Code code = Ok) : code_(code) {}
+    explicit operator bool() const { return code_ != Ok; }
+    Code code() const { return code_; }
+    const char* c_str() const {
+      static const char* names[] = {"Ok", "EmptyInput", "IncompleteInput", "InvalidInput", "NoMemory"};
+      return names[code_];
+    }
+    const char* f_str() const { return c_str(); }
+
+  private:
+    Code code_;
+};
+
+namespace DeserializationOption {
+  class Filter {
+    public:
+      Filter(const JsonVariant& filter) : filter(filter) {}
+      JsonVariant filter;
+  };
+}
+
+DeserializationError deserializeJsonText(JsonDocument& document, const std::string& input, const JsonNode* filter);
+
+inline DeserializationError deserializeJson(JsonDocument& document, const String& input) { return deserializeJsonText(document, input.s, nullptr); }
+inline DeserializationError deserializeJson(JsonDocument& document, const char* input) { return deserializeJsonText(document, input != nullptr ? input : "", nullptr); }
+inline DeserializationError deserializeJson(JsonDocument& document, Stream& input) { return deserializeJsonText(document, input.readString().s, nullptr); }
+inline DeserializationError deserializeJson(JsonDocument& document, const String& input, DeserializationOption::Filter filter) {
+  return deserializeJsonText(document, input.s, filter.filter.find());
+}
+inline DeserializationError deserializeJson(JsonDocument& document, Stream& input, DeserializationOption::Filter filter) {
+  return deserializeJsonText(document, input.readString().s, filter.filter.find());
+}
+
+inline size_t serializeJson(const JsonVariant& variant, String& output) {
+  output.s.clear();
+  return variant.find() != nullptr ? serializeJsonNode(*variant.find(), output.s) : 0;
+}
+inline size_t serializeJson(const JsonVariant& variant, Print& output) {
+  String text;
+  serializeJson(variant, text);
+  return output.write((const uint8_t*)text.c_str(), text.length());
+}
+inline size_t measureJson(const JsonVariant& variant) {
+  String text;
+  return serializeJson(variant, text);
+}
@@ -0,0 +1,16 @@
+// Host stand-in for over-the-air updates, which never start on the host.
+#pragma once
+#include "Arduino.h"
+
+typedef enum { OTA_AUTH_ERROR, OTA_BEGIN_ERROR, OTA_CONNECT_ERROR, OTA_RECEIVE_ERROR, OTA_END_ERROR } ota_error_t;
+
+class ArduinoOTAClass {
+  public:
+    void setHostname(const char*) {}
+    void onStart(std::function<void()>) {}
+    void onEnd(std::function<void()>) {}
+    void onError(std::function<void(ota_error_t)>) {}
+    void begin() {}
+    void handle() {}
+};
+extern ArduinoOTAClass ArduinoOTA;
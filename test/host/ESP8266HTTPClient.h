@@ -0,0 +1,25 @@
+// Host stand-in for the HTTP client: calls are recorded in host_http_calls and answered with host_http_code.
+#pragma once
+#include "ESP8266WiFi.h"
+
+#define HTTP_CODE_OK 200
+#define HTTPC_ERROR_CONNECTION_FAILED (-1)
+#define HTTPCLIENT_DEFAULT_TCP_TIMEOUT (5000)
+
+class HTTPClient {
+  public:
+    bool begin(WiFiClient&, const String& url) { this->url = url; return true; }
+    void addHeader(const String&, const String&) {}
+    void setTimeout(uint16_t) {}
+    int PUT(const String& body) { return request("PUT", body); }
+    int POST(const String& body) { return request("POST", body); }
+    int GET() { return request("GET", ""); }
+    int getSize() { return reply.length(); }
+    String getString() { return reply; }
+    void end() {}
+
+  private:
+    int request(const char* method, const String& body);
+    String url;
+    String reply;
+};
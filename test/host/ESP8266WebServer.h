@@ -0,0 +1,45 @@
+// Host stand-in for the web server: handlers are called through host_request().
+#pragma once
+#include <map>
+#include "ESP8266WiFi.h"
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_OPTIONS };
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+
+class ESP8266WebServer {
+  public:
+    ESP8266WebServer(int) {}
+    void begin() {}
+    void handleClient() {}
+    void on(const String& uri, HTTPMethod method, std::function<void()> handler) { handlers.push_back({uri, method, handler}); }
+    void on(const String& uri, std::function<void()> handler) { on(uri, HTTP_ANY, handler); }
+    void onNotFound(std::function<void()> handler) { not_found = handler; }
+
+    bool hasArg(const String& name) { return args.count(name.s) > 0; }
+    String arg(const String& name) { return hasArg(name) ? args[name.s] : String(); }
+    String uri() { return current_uri; }
+    HTTPMethod method() { return current_method; }
+    WiFiClient& client() { return current_client; }
+
+    void send(int code, const char* type, const String& content) { reply_code = code; reply += content; }
+    void send(int code, const String& type, const String& content) { send(code, type.c_str(), content); }
+    void send(int code) { reply_code = code; }
+    void sendHeader(const String& name, const String& value, bool first = false) {}
+    void setContentLength(size_t) {}
+    void sendContent(const String& content) { reply += content; }
+    void sendContent(const char* content, size_t size) { reply.concat(content, size); }
+
+    struct Handler {
+      String uri;
+      HTTPMethod method;
+      std::function<void()> function;
+    };
+    std::vector<Handler> handlers;
+    std::function<void()> not_found;
+    std::map<std::string, String> args;
+    String current_uri;
+    HTTPMethod current_method = HTTP_GET;
+    WiFiClient current_client;
+    int reply_code = 0;
+    String reply;
+};
@@ -0,0 +1,61 @@
+// Host stand-in for the ESP8266 Wi-Fi station and TCP client.
+#pragma once
+#include <memory>
+#include "Arduino.h"
+
+#define WL_IDLE_STATUS 0
+#define WL_DISCONNECTED 6
+#define WL_CONNECTED 3
+#define WIFI_STA 1
+
+extern int host_wifi_status;
+extern IPAddress host_local_ip;
+
+class WiFiClass {
+  public:
+    void mode(int) {}
+    void begin() {}
+    void begin(const char*, const char*) {}
+    void disconnect() {}
+    int status() { return host_wifi_status; }
+    String SSID() { return host_wifi_status == WL_CONNECTED ? "host" : ""; }
+    String psk() { return host_wifi_status == WL_CONNECTED ? "password" : ""; }
+    String macAddress() { return "5C:CF:7F:00:00:01"; }
+    IPAddress localIP() { return host_wifi_status == WL_CONNECTED ? host_local_ip : IPAddress(); }
+    bool beginWPSConfig() { return host_wifi_status == WL_CONNECTED; }
+    void setAutoReconnect(bool) {}
+    void hostname(const char*) {}
+    int hostByName(const char*, IPAddress& address) { address = IPAddress(1, 1, 1, 1); return 1; }
+};
+extern WiFiClass WiFi;
+
+class WiFiClient : public Stream { // Copies share one connection, like the handles of the real client.
+  public:
+    WiFiClient() {}
+    int connect(const IPAddress&, uint16_t) { return 0; }
+    int connect(const char*, uint16_t) { return 0; }
+    uint8_t connected() { return connection && connection->open; }
+    void stop() {
+      if (connection) {
+        connection->open = false;
+      }
+    }
+    void setNoDelay(bool) {}
+    size_t write(uint8_t c) override {
+      if (!connected()) {
+        return 0;
+      }
+      connection->sent += (char)c;
+      return 1;
+    }
+    using Print::write;
+    explicit operator bool() const { return (bool)connection; }
+    IPAddress remoteIP() { return connection ? connection->remote_ip : IPAddress(); }
+
+    struct Connection {
+      bool open = true;
+      String sent;
+      IPAddress remote_ip;
+    };
+    std::shared_ptr<Connection> connection;
+};
@@ -0,0 +1,27 @@
+// Host stand-in for mDNS: the service query answers with host_mdns_peers.
+#pragma once
+#include "ESP8266WiFi.h"
+
+extern std::vector<IPAddress> host_mdns_peers;
+
+class MDNSResponder {
+  public:
+    enum class AnswerType { Unknown, ServiceDomain, HostDomainAndPort, Txt, IP4Address, IP6Address };
+    class MDNSServiceInfo {
+      public:
+        std::vector<IPAddress> IP4Adresses() { return {}; }
+        bool IP4AddressAvailable() { return false; }
+        const char* hostDomain() { return ""; }
+        const char* serviceDomain() { return ""; }
+    };
+    typedef void* hMDNSServiceQuery;
+    typedef std::function<void(MDNSServiceInfo, AnswerType, bool)> MDNSServiceQueryCallbackFunc;
+
+    bool begin(const char*) { return true; }
+    void update() {}
+    bool addService(const char*, const char*, uint16_t) { return true; }
+    int queryService(const char*, const char*) { return host_mdns_peers.size(); }
+    IPAddress IP(int index) { return host_mdns_peers[index]; }
+    hMDNSServiceQuery installServiceQuery(const char*, const char*, MDNSServiceQueryCallbackFunc) { return nullptr; }
+};
+extern MDNSResponder MDNS;
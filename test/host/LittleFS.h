@@ -0,0 +1,83 @@
+// Host stand-in for LittleFS: files live in host_files, keyed by their path.
+#pragma once
+#include <map>
+#include "Arduino.h"
+
+extern std::map<std::string, std::string> host_files;
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+class File : public Stream {
+  public:
+    File() {}
+    File(const std::string& path, bool append) : path(path), position_(append ? data().size() : 0), append(append), open(true) {}
+    explicit operator bool() const { return open; }
+    void close() { open = false; }
+
+    size_t size() const { return open ? host_files[path].size() : 0; }
+    size_t position() const { return position_; }
+    bool seek(uint32_t offset, SeekMode mode = SeekSet) {
+      size_t target = mode == SeekSet ? offset : (mode == SeekCur ? position_ + offset : size() + offset);
+      if (!open || target > size()) {
+        return false;
+      }
+      position_ = target;
+      return true;
+    }
+    int available() override { return open ? size() - position_ : 0; }
+    int peek() override { return available() > 0 ? (uint8_t)data()[position_] : -1; }
+    int read() override { return available() > 0 ? (uint8_t)data()[position_++] : -1; }
+    int read(uint8_t* buffer, size_t size) { return readBytes(buffer, size); }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buffer, size_t size) override {
+      if (!open) {
+        return 0;
+      }
+      if (append) {
+        position_ = data().size();
+      }
+      data().replace(position_, std::min(size, data().size() - position_), (const char*)buffer, size);
+      position_ += size;
+      return size;
+    }
+    using Print::write;
+    bool truncate(uint32_t size) {
+      data().resize(size);
+      position_ = std::min(position_, (size_t)size);
+      return open;
+    }
+    String name() const { return path.substr(path.rfind('/') + 1); }
+
+  private:
+    std::string& data() const { return host_files[path]; }
+    std::string path;
+    size_t position_ = 0;
+    bool append = false;
+    bool open = false;
+};
+
+class FS {
+  public:
+    bool begin() { return true; }
+    File open(const String& path, const char* mode) {
+      bool exists = host_files.count(path.s) > 0;
+      if (mode[0] == 'r' && !exists) {
+        return File();
+      }
+      if (mode[0] == 'w') {
+        host_files[path.s] = "";
+      }
+      return File(path.s, mode[0] == 'a');
+    }
+    bool exists(const String& path) { return host_files.count(path.s) > 0; }
+    bool remove(const String& path) { return host_files.erase(path.s) > 0; }
+    bool rename(const String& from, const String& to) {
+      if (!exists(from)) {
+        return false;
+      }
+      host_files[to.s] = host_files[from.s];
+      host_files.erase(from.s);
+      return true;
+    }
+};
+extern FS LittleFS;
@@ -0,0 +1,57 @@
+// Host stand-in for RTClib. The DS1307 keeps counting with the virtual clock once adjusted.
+#pragma once
+#include <time.h>
+#include "Arduino.h"
+
+extern bool host_rtc_running;
+
+class DateTime {
+  public:
+    DateTime(uint32_t u_time = 0) : u_time(u_time) {
+      time_t t = u_time;
+      gmtime_r(&t, &parts);
+    }
+    DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour = 0, uint8_t minute = 0, uint8_t second = 0) {
+      struct tm t = {};
+      t.tm_year = year - 1900;
+      t.tm_mon = month - 1;
+      t.tm_mday = day;
+      t.tm_hour = hour;
+      t.tm_min = minute;
+      t.tm_sec = second;
+      *this = DateTime((uint32_t)timegm(&t));
+    }
+    uint16_t year() const { return parts.tm_year + 1900; }
+    uint8_t month() const { return parts.tm_mon + 1; }
+    uint8_t day() const { return parts.tm_mday; }
+    uint8_t hour() const { return parts.tm_hour; }
+    uint8_t minute() const { return parts.tm_min; }
+    uint8_t second() const { return parts.tm_sec; }
+    uint8_t dayOfTheWeek() const { return parts.tm_wday; }
+    uint32_t unixtime() const { return u_time; }
+
+  private:
+    uint32_t u_time;
+    struct tm parts;
+};
+
+class RTC_DS1307 {
+  public:
+    bool begin() { return true; }
+    bool isrunning() { return host_rtc_running; }
+    DateTime now() { return DateTime(set_u_time + (millis() - set_millis) / 1000); }
+    void adjust(const DateTime& date) {
+      set_u_time = date.unixtime();
+      set_millis = millis();
+      host_rtc_running = true;
+    }
+
+  private:
+    uint32_t set_u_time = 946684800;
+    uint32_t set_millis = 0;
+};
+
+class RTC_Millis : public RTC_DS1307 {
+  public:
+    void begin(const DateTime& date) { adjust(date); }
+};
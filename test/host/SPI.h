@@ -0,0 +1,2 @@
+// Host stand-in for SPI, which the firmware includes but does not use.
+#pragma once
@@ -0,0 +1,46 @@
+// Host stand-in for UDP. Datagrams go through an in-process network: multicast ones reach every
+// socket joined to the group, the sender included, as with IP_MULTICAST_LOOP; NTP requests are
+// answered from the virtual clock.
+#pragma once
+#include <deque>
+#include "Arduino.h"
+
+struct HostDatagram {
+  IPAddress source;
+  IPAddress destination;
+  uint16_t port;
+  std::string data;
+};
+
+class WiFiUDP : public Stream {
+  public:
+    WiFiUDP();
+    ~WiFiUDP();
+    uint8_t begin(uint16_t port) { local_port = port; return 1; }
+    uint8_t beginMulticast(IPAddress, IPAddress group, uint16_t port) { this->group = group; local_port = port; return 1; }
+    void stop() { group = IPAddress(); local_port = 0; inbox.clear(); }
+
+    int beginPacket(IPAddress address, uint16_t port) { outgoing = {IPAddress(), address, port, ""}; return 1; }
+    int beginPacket(const char* host, uint16_t port) { return beginPacket(IPAddress(1, 1, 1, 1), port); }
+    int beginPacketMulticast(IPAddress address, uint16_t port, IPAddress, int = 1) { return beginPacket(address, port); }
+    size_t write(uint8_t c) override { outgoing.data += (char)c; return 1; }
+    size_t write(const uint8_t* buffer, size_t size) override { outgoing.data.append((const char*)buffer, size); return size; }
+    using Print::write;
+    int endPacket();
+
+    int parsePacket();
+    int available() override { return incoming.data.size() - offset; }
+    int read() override { return available() > 0 ? (uint8_t)incoming.data[offset++] : -1; }
+    int read(uint8_t* buffer, size_t size) { return readBytes(buffer, size); }
+    int read(char* buffer, size_t size) { return readBytes(buffer, size); }
+    IPAddress remoteIP() { return incoming.source; }
+
+    IPAddress group;
+    uint16_t local_port = 0;
+    std::deque<HostDatagram> inbox;
+
+  private:
+    HostDatagram outgoing;
+    HostDatagram incoming;
+    size_t offset = 0;
+};
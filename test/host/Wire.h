@@ -0,0 +1,8 @@
+// Host stand-in for the I2C bus of the RTC.
+#pragma once
+
+class TwoWire {
+  public:
+    void begin() {}
+};
+extern TwoWire Wire;
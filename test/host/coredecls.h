@@ -0,0 +1,15 @@
+// Host stand-in for the ESP8266 core declarations used by the firmware.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+inline uint32_t crc32(const void* data, size_t length, uint32_t crc = 0xffffffff) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (length--) {
+    crc ^= *p++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,382 @@
+// Globals of the host stand-ins: the virtual clock, timer1, GPIO, network and the JSON parser.
+#include <chrono>
+#include "host.h"
+#include "ArduinoJson.h"
+#include "ArduinoOTA.h"
+#include "ESP8266HTTPClient.h"
+#include "ESP8266mDNS.h"
+#include "LittleFS.h"
+#include "RTClib.h"
+#include "WiFiUdp.h"
+#include "Wire.h"
+
+void loop();
+extern ESP8266WebServer server;
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+ArduinoOTAClass ArduinoOTA;
+TwoWire Wire;
+FS LittleFS;
+
+uint64_t host_us = 0;
+uint32_t host_epoch = 1772355600; // 1 March 2026, 9:00 UTC.
+uint8_t host_pins[32];
+int host_analog = 0;
+bool host_trace = false;
+std::vector<HostPinEvent> host_pin_trace;
+uint32_t host_timer_calls = 0;
+bool host_rtc_running = false;
+
+int host_wifi_status = WL_CONNECTED;
+IPAddress host_local_ip(192, 168, 1, 10);
+IPAddress host_remote_ip(192, 168, 1, 2);
+std::vector<IPAddress> host_mdns_peers;
+std::vector<HostHttpCall> host_http_calls;
+int host_http_code = HTTP_CODE_OK;
+String host_http_reply = "";
+
+std::map<std::string, std::string> host_files;
+
+static timercallback timer_routine = nullptr;
+static bool timer_enabled = false;
+static uint32_t timer_interval_us = 0;
+static uint64_t timer_due_us = 0;
+
+static std::vector<WiFiUDP*>& sockets() { // Built on first use, as sockets are globals of other files.
+  static std::vector<WiFiUDP*>* list = new std::vector<WiFiUDP*>();
+  return *list;
+}
+
+void host_advance(uint64_t us) {
+  uint64_t target = host_us + us;
+  while (timer_enabled && timer_routine != nullptr && timer_interval_us > 0 && timer_due_us <= target) {
+    host_us = std::max(host_us, timer_due_us);
+    timer_due_us = host_us + timer_interval_us; // The routine may write a new interval for the next tick.
+    host_timer_calls++;
+    timer_routine();
+  }
+  host_us = target;
+}
+
+void host_run(uint32_t ms, uint32_t loop_us) {
+  uint64_t end = host_us + (uint64_t)ms * 1000;
+  while (host_us < end) {
+    loop();
+    host_advance(loop_us);
+  }
+}
+
+HostReply host_request(HTTPMethod method, const String& uri, const String& body) {
+  server.args.clear();
+  String path = uri;
+  int query = uri.indexOf('?');
+  if (query > -1) {
+    path = uri.substring(0, query);
+    String arguments = uri.substring(query + 1) + "&";
+    for (int start = 0, end; (end = arguments.indexOf('&', start)) > -1; start = end + 1) {
+      String argument = arguments.substring(start, end);
+      int equals = argument.indexOf('=');
+      if (equals > 0) {
+        server.args[argument.substring(0, equals).s] = argument.substring(equals + 1);
+      }
+    }
+  }
+  if (body.length() > 0) {
+    server.args["plain"] = body;
+  }
+  server.current_uri = path;
+  server.current_method = method;
+  server.current_client = WiFiClient();
+  server.current_client.connection = std::make_shared<WiFiClient::Connection>();
+  server.current_client.connection->remote_ip = host_remote_ip;
+  server.reply_code = 0;
+  server.reply = "";
+
+  for (ESP8266WebServer::Handler& handler : server.handlers) {
+    if (handler.uri == path && (handler.method == HTTP_ANY || handler.method == method)) {
+      handler.function();
+      return {server.reply_code, server.reply};
+    }
+  }
+  if (server.not_found) {
+    server.not_found();
+    return {server.reply_code, server.reply};
+  }
+  return {404, ""};
+}
+
+void host_reset() {
+  host_files.clear();
+  host_pin_trace.clear();
+  host_http_calls.clear();
+  host_mdns_peers.clear();
+  for (WiFiUDP* socket : sockets()) {
+    socket->inbox.clear();
+  }
+}
+
+unsigned long millis() {
+  return host_us / 1000;
+}
+
+unsigned long micros() { // The host's own clock runs on top, so profile() measures what the code costs here.
+  static auto start = std::chrono::steady_clock::now();
+  return host_us + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void delay(unsigned long ms) {
+  host_advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  host_advance(us);
+}
+
+void yield() {}
+
+uint32_t EspClass::getCycleCount() {
+  return host_us * 80;
+}
+
+size_t HardwareSerial::write(uint8_t) {
+  return 1;
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  host_pins[pin] = value;
+  if (host_trace) {
+    host_pin_trace.push_back({host_us, pin, value});
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return host_pins[pin];
+}
+
+int analogRead(uint8_t) {
+  return host_analog;
+}
+
+void noInterrupts() {} // The timer routine only runs from host_advance(), never in the middle of loop code.
+
+void interrupts() {}
+
+void timer1_attachInterrupt(timercallback routine) {
+  timer_routine = routine;
+}
+
+void timer1_detachInterrupt() {
+  timer_routine = nullptr;
+}
+
+void timer1_enable(uint8_t, uint8_t, uint8_t) {
+  timer_enabled = true;
+}
+
+void timer1_disable() {
+  timer_enabled = false;
+}
+
+void timer1_write(uint32_t ticks) { // TIM_DIV16 at 80 MHz gives 5 ticks per microsecond.
+  timer_interval_us = ticks / 5;
+  timer_due_us = host_us + timer_interval_us;
+}
+
+int HTTPClient::request(const char* method, const String& body) {
+  host_http_calls.push_back({method, url, body});
+  reply = host_http_code == HTTP_CODE_OK ? host_http_reply : "";
+  return host_http_code;
+}
+
+WiFiUDP::WiFiUDP() {
+  sockets().push_back(this);
+}
+
+WiFiUDP::~WiFiUDP() {
+  sockets().erase(std::find(sockets().begin(), sockets().end(), this));
+}
+
+int WiFiUDP::endPacket() {
+  outgoing.source = host_local_ip;
+  if (outgoing.port == 123 && outgoing.data.size() >= 48) { // NTP: transmit time in seconds since 1900.
+    HostDatagram reply = {IPAddress(1, 1, 1, 1), host_local_ip, local_port, std::string(48, 0)};
+    uint32_t seconds = host_epoch + millis() / 1000 + 2208988800UL;
+    reply.data[0] = 0x24;
+    for (int i = 0; i < 4; i++) {
+      reply.data[40 + i] = seconds >> (24 - 8 * i);
+    }
+    inbox.push_back(reply);
+    return 1;
+  }
+  for (WiFiUDP* socket : sockets()) {
+    if (socket->local_port == outgoing.port && socket->group.isSet() && socket->group == outgoing.destination) {
+      socket->inbox.push_back(outgoing);
+    }
+  }
+  return 1;
+}
+
+int WiFiUDP::parsePacket() {
+  if (inbox.empty()) {
+    return 0;
+  }
+  incoming = inbox.front();
+  inbox.pop_front();
+  offset = 0;
+  return incoming.data.size();
+}
+
+static void skipSpace(const std::string& input, size_t& p) {
+  while (p < input.size() && isspace((unsigned char)input[p])) {
+    p++;
+  }
+}
+
+static bool parseText(const std::string& input, size_t& p, std::string& text) {
+  for (p++; p < input.size() && input[p] != '"'; p++) {
+    if (input[p] == '\\' && p + 1 < input.size()) {
+      char c = input[++p];
+      text += c == 'n' ? '\n' : (c == 't' ? '\t' : (c == 'r' ? '\r' : c));
+    } else {
+      text += input[p];
+    }
+  }
+  return p++ < input.size();
+}
+
+static DeserializationError::Code parseNode(const std::string& input, size_t& p, JsonNode& node, const JsonNode* filter, int depth) {
+  skipSpace(input, p);
+  if (p >= input.size()) {
+    return DeserializationError::IncompleteInput;
+  }
+  if (depth > 10) {
+    return DeserializationError::NoMemory;
+  }
+  bool keep = filter == nullptr || filter->type != JsonNode::null;
+  const JsonNode* every = filter != nullptr && filter->type == JsonNode::boolean && filter->integer_value ? nullptr : filter;
+
+  char c = input[p];
+  if (c == '{' || c == '[') {
+    node.type = c == '{' ? JsonNode::object : JsonNode::array;
+    for (p++, skipSpace(input, p); p < input.size() && input[p] != (c == '{' ? '}' : ']');) {
+      std::string key;
+      const JsonNode* child_filter = every;
+      if (c == '{') {
+        if (input[p] != '"' || !parseText(input, p, key)) {
+          return DeserializationError::InvalidInput;
+        }
+        skipSpace(input, p);
+        if (p >= input.size() || input[p++] != ':') {
+          return DeserializationError::InvalidInput;
+        }
+        if (every != nullptr) {
+          child_filter = every->type == JsonNode::object ? const_cast<JsonNode*>(every)->member(key) : nullptr;
+          static const JsonNode skipped;
+          child_filter = child_filter != nullptr ? child_filter : &skipped;
+        }
+      } else if (every != nullptr && every->type == JsonNode::array && !every->items.empty()) {
+        child_filter = &every->items[0];
+      }
+      JsonNode child;
+      DeserializationError::Code code = parseNode(input, p, child, child_filter, depth + 1);
+      if (code != DeserializationError::Ok) {
+        return code;
+      }
+      if (child_filter == nullptr || child_filter->type != JsonNode::null) {
+        if (c == '{') {
+          node.keys.push_back(key);
+        }
+        node.items.push_back(child);
+      }
+      skipSpace(input, p);
+      if (p < input.size() && input[p] == ',') {
+        p++;
+        skipSpace(input, p);
+      }
+    }
+    if (p++ >= input.size()) {
+      return DeserializationError::IncompleteInput;
+    }
+  } else if (c == '"') {
+    node.type = JsonNode::text;
+    if (!parseText(input, p, node.text_value)) {
+      return DeserializationError::IncompleteInput;
+    }
+  } else if (input.compare(p, 4, "true") == 0 || input.compare(p, 5, "false") == 0) {
+    node.type = JsonNode::boolean;
+    node.integer_value = c == 't';
+    p += c == 't' ? 4 : 5;
+  } else if (input.compare(p, 4, "null") == 0) {
+    p += 4;
+  } else if (c == '-' || isDigit(c)) {
+    size_t start = p;
+    bool integer = true;
+    for (p++; p < input.size() && (isDigit(input[p]) || strchr(".eE+-", input[p]) != nullptr); p++) {
+      integer &= isDigit(input[p]);
+    }
+    std::string number = input.substr(start, p - start);
+    node.type = integer ? JsonNode::integer : JsonNode::real;
+    node.integer_value = atoll(number.c_str());
+    node.real_value = atof(number.c_str());
+  } else {
+    return DeserializationError::InvalidInput;
+  }
+  if (!keep) {
+    node = JsonNode();
+  }
+  return DeserializationError::Ok;
+}
+
+DeserializationError deserializeJsonText(JsonDocument& document, const std::string& input, const JsonNode* filter) {
+  document.clear();
+  size_t p = 0;
+  skipSpace(input, p);
+  if (p >= input.size()) {
+    return DeserializationError::EmptyInput;
+  }
+  DeserializationError::Code code = parseNode(input, p, document.tree, filter, 0);
+  if (code != DeserializationError::Ok) {
+    document.clear();
+  }
+  return code;
+}
+
+size_t serializeJsonNode(const JsonNode& node, std::string& output) {
+  size_t start = output.size();
+  if (node.type == JsonNode::null) {
+    output += "null";
+  } else if (node.type == JsonNode::boolean) {
+    output += node.integer_value ? "true" : "false";
+  } else if (node.type == JsonNode::integer) {
+    output += std::to_string(node.integer_value);
+  } else if (node.type == JsonNode::real) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", node.real_value);
+    output += buffer;
+  } else if (node.type == JsonNode::text) {
+    output += '"';
+    for (char c : node.text_value) {
+      if (c == '"' || c == '\\') {
+        output += '\\';
+      }
+      output += c;
+    }
+    output += '"';
+  } else {
+    output += node.type == JsonNode::object ? '{' : '[';
+    for (size_t i = 0; i < node.items.size(); i++) {
+      output += i > 0 ? "," : "";
+      if (node.type == JsonNode::object) {
+        output += "\"" + node.keys[i] + "\":";
+      }
+      serializeJsonNode(node.items[i], output);
+    }
+    output += node.type == JsonNode::object ? '}' : ']';
+  }
+  return output.size() - start;
+}
@@ -0,0 +1,46 @@
+// Controls of the host stand-ins, used by the simulation and the tests.
+#pragma once
+#include <map>
+#include "Arduino.h"
+#include "ESP8266WebServer.h"
+
+struct HostPinEvent {
+  uint64_t us;
+  uint8_t pin;
+  uint8_t value;
+};
+
+struct HostHttpCall {
+  String method;
+  String url;
+  String body;
+};
+
+struct HostReply {
+  int code;
+  String content;
+};
+
+extern uint64_t host_us; // Virtual time since the boot.
+extern uint32_t host_epoch; // Unix time the virtual clock started at, served by NTP.
+extern uint8_t host_pins[32];
+extern int host_analog;
+extern bool host_trace; // Records every digitalWrite into host_pin_trace.
+extern std::vector<HostPinEvent> host_pin_trace;
+extern uint32_t host_timer_calls;
+extern bool host_rtc_running;
+
+extern int host_wifi_status;
+extern IPAddress host_local_ip;
+extern IPAddress host_remote_ip; // Address the requests of host_request() come from.
+extern std::vector<IPAddress> host_mdns_peers;
+extern std::vector<HostHttpCall> host_http_calls;
+extern int host_http_code;
+extern String host_http_reply;
+
+extern std::map<std::string, std::string> host_files;
+
+void host_advance(uint64_t us); // Moves the virtual clock on, running timer1 whenever it is due.
+void host_run(uint32_t ms, uint32_t loop_us); // Calls loop() for ms of virtual time, each pass taking loop_us.
+HostReply host_request(HTTPMethod method, const String& uri, const String& body);
+void host_reset();
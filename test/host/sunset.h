@@ -0,0 +1,14 @@
+// Host stand-in for SunSet, with the sun rising at 6:00 and setting at 18:00 local time.
+#pragma once
+
+class SunSet {
+  public:
+    void setPosition(double, double, double timezone) { this->timezone = timezone; }
+    void setTZOffset(double timezone) { this->timezone = timezone; }
+    void setCurrentDate(int, int, int) {}
+    double calcSunrise() { return 360; }
+    double calcSunset() { return 1080; }
+
+  private:
+    double timezone = 0;
+};
@@ -0,0 +1,57 @@
+// Starts a move from the phone and sends commands of lower origins during it, from an iDom peer and
+// from a rule, then checks that the blinds stop where the user put them. A cloud order counts as manual.
+#include "../src/main.cpp"
+#include "host.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* message) {
+  if (!condition) {
+    printf("FAIL: %s\n", message);
+    failures++;
+  }
+}
+
+static void setFrom(IPAddress ip, const String& body) {
+  IPAddress remote_ip = host_remote_ip;
+  host_remote_ip = ip;
+  check(host_request(HTTP_PUT, "/set", body).code == 200, "/set accepted");
+  host_remote_ip = remote_ip;
+}
+
+int main() {
+  IPAddress phone(192, 168, 1, 2);
+  IPAddress peer(192, 168, 1, 20);
+
+  host_files["/settings.txt"] = "{\"ver\":\"30.25\",\"gen\":1,\"ssid\":\"host\",\"password\":\"password\",\"steps\":[3000,3000,3000]}";
+  host_mdns_peers = {peer};
+  setup();
+  host_run(10000, 1000);
+  check(isPeer(peer.toString()), "peer known");
+  check(!isPeer(phone.toString()), "phone isn't a peer");
+
+  setFrom(phone, "{\"val\":\"100\"}");
+  host_run(1000, 1000);
+  check(motion_origin == origin_manual, "manual move running");
+  setFrom(peer, "{\"val\":\"0\"}");
+  int smart_destination[] = {600, 600, -1};
+  queueMotion(smart_destination, "smart");
+  host_run(1000, 1000);
+  check(destination[0] == 3000 && destination[2] == 3000, "lower origins wait for the manual move");
+  host_run(200000, 1000);
+  check(actual[0] == 3000 && actual[1] == 3000 && actual[2] == 3000, "manual target kept after the move");
+  check(!motion_queue[origin_peer].pending && !motion_queue[origin_smart].pending, "superseded commands dropped");
+
+  int smart_move[] = {0, 0, 0};
+  queueMotion(smart_move, "smart");
+  host_run(1000, 1000);
+  check(motion_origin == origin_smart, "smart move running");
+  readData("{\"val\":\"100\"}", false);
+  host_run(1000, 1000);
+  check(motion_origin == origin_manual && destination[0] == 3000, "cloud order overrides a rule");
+  host_run(200000, 1000);
+  check(actual[0] == 3000, "cloud target reached");
+
+  printf(failures == 0 ? "OK\n" : "%d checks failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
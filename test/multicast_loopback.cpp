@@ -0,0 +1,90 @@
+// Sends announcements from a peer address over the in-process multicast group and checks that the
+// firmware applies them, drops repeats and keeps /set for the peers that don't announce themselves.
+#include "../src/main.cpp"
+#include "host.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* message) {
+  if (!condition) {
+    printf("FAIL: %s\n", message);
+    failures++;
+  }
+}
+
+static void sendFrom(IPAddress ip, const Announcement& announcement) {
+  WiFiUDP peer;
+  IPAddress local_ip = host_local_ip;
+  host_local_ip = ip;
+  peer.beginPacketMulticast(multicast_address, multicast_port, ip);
+  peer.write((const uint8_t*)&announcement, sizeof(announcement));
+  peer.endPacket();
+  host_local_ip = local_ip;
+}
+
+static int findDevice(IPAddress ip) {
+  for (int i = 0; i < devices_count; i++) {
+    if (devices_array[i].ip == ip.toString()) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main() {
+  IPAddress announcing(192, 168, 1, 20);
+  IPAddress silent(192, 168, 1, 30);
+
+  host_files["/settings.txt"] = "{\"ver\":\"30.25\",\"gen\":1,\"ssid\":\"host\",\"password\":\"password\",\"steps\":[3000,3000,3000],\"multicast\":1}";
+  host_mdns_peers = {announcing, silent};
+  setup();
+  host_run(10000, 1000);
+  check(multicast, "multicast setting read");
+
+  announce(announce_light);
+  host_run(100, 1000);
+  check(findDevice(host_local_ip) == -1, "own announcement ignored");
+
+  Announcement announcement = {{'i', 'D'}, announce_light | announce_twilight | announce_position, true, 7, 12, {40, 60, -1}, 0};
+  sendFrom(announcing, announcement);
+  host_run(100, 1000);
+  int device = findDevice(announcing);
+  check(device > -1, "announcing peer known");
+  check(device > -1 && devices_array[device].sequence == 7, "sequence stored");
+  check(device > -1 && devices_array[device].position[0] == 40 && devices_array[device].position[1] == 60 && devices_array[device].position[2] == -1, "position stored");
+  check(sensor_twilight, "twilight applied");
+
+  announcement.twilight = false;
+  announcement.fields = announce_light | announce_twilight;
+  sendFrom(announcing, announcement); // Same sequence: a repeat.
+  host_run(100, 1000);
+  check(sensor_twilight, "repeat dropped");
+
+  announcement.sequence = 8;
+  sendFrom(announcing, announcement);
+  host_run(100, 1000);
+  check(!sensor_twilight, "next announcement applied");
+  check(device > -1 && devices_array[device].position[0] == 40, "position kept when not announced");
+
+  for (int i = 0; i < devices_count; i++) {
+    devices_array[i].pending = "";
+  }
+  putMultiOfflineData("{\"light\":\"12\"}", false);
+  check(device > -1 && devices_array[device].pending.length() == 0, "no /set for an announcing peer");
+  check(findDevice(silent) > -1 && devices_array[findDevice(silent)].pending.length() > 0, "/set kept for a silent peer");
+
+  host_http_calls.clear();
+  host_run(3000, 1000);
+  bool sent = false;
+  for (const HostHttpCall& call : host_http_calls) {
+    check(call.url.indexOf(announcing.toString()) == -1, "nothing sent to the announcing peer");
+    sent |= call.url == "http://" + silent.toString() + "/set";
+  }
+  check(sent, "silent peer got /set");
+
+  HostReply reply = host_request(HTTP_GET, "/test/performance", "");
+  check(reply.content.indexOf("\"" + announcing.toString() + "\"") > -1 && reply.content.indexOf(",\"40;60;-1\"]") > -1, "position reported among peers");
+
+  printf(failures == 0 ? "OK\n" : "%d checks failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
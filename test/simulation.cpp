@@ -0,0 +1,47 @@
+// Runs the firmware on the virtual clock with a set of smart rules and prints how it kept up:
+// simulation [days] [rules] [loop_us]
+#include <chrono>
+#include "../src/main.cpp"
+#include "host.h"
+
+int main(int argc, char* argv[]) {
+  int days = argc > 1 ? atoi(argv[1]) : 7;
+  int rules = argc > 2 ? atoi(argv[2]) : 40;
+  uint32_t loop_us = argc > 3 ? atoi(argv[3]) : 10000;
+
+  host_files["/settings.txt"] = "{\"ver\":\"30.25\",\"gen\":1,\"ssid\":\"host\",\"password\":\"password\",\"steps\":[3000,3000,1500],\"location\":\"52.2x21.0\"}";
+  host_analog = 500;
+  setup();
+  host_run(10000, loop_us);
+
+  String smart = "";
+  for (int i = 0; i < rules; i++) { // Mornings and evenings at spread times, sunset, dusk and dawn rules.
+    String rule = i % 4 == 0 ? "b4|0|n" : (i % 4 == 1 ? "b1|100|<" : (i % 4 == 2 ? "b2|50|>" : "b3" + String(days_of_the_week[i % 7]) + "|" + String(i % 100) + "|" + String(360 + i * 7 % 900) + "_"));
+    smart += (i > 0 ? "," : "") + rule;
+  }
+  HostReply reply = host_request(HTTP_PUT, "/set", "{\"smart\":\"" + smart + "\"}");
+  if (reply.code != 200) {
+    printf("Rules rejected: %d %s\n", reply.code, reply.content.c_str());
+    return 1;
+  }
+
+  uint64_t start_us = host_us;
+  uint32_t light_period = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int hour = 0; hour < days * 24; hour++) {
+    int local_hour = (rtc.now().hour() + 24) % 24;
+    host_analog = local_hour >= 6 && local_hour < 18 ? 600 + 100 * (light_period++ % 3) : 20;
+    host_run(3600000, loop_us);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t passes = (host_us - start_us) / loop_us;
+  printf("%d days, %d rules: %llu loop passes in %.2f s, %.0f passes per second\n", days, smart_count, (unsigned long long)passes, seconds, passes / seconds);
+  for (int i = 0; i < profiles; i++) {
+    if (profile_array[i].count > 0) {
+      printf("%-9s %8u calls, %6u us average, %6u us longest\n", profile_names[i], profile_array[i].count, (uint32_t)(profile_array[i].total_us / profile_array[i].count), profile_array[i].max_us);
+    }
+  }
+  printf("position %s, %u movements\n", getValue().c_str(), cycles[0] + cycles[1] + cycles[2]);
+  return smart_count == rules ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+// Sets a rule due in two minutes, clears the rules, and checks that nothing fires at its time, either
+// through /set or through /smart, and that a light change reaches no cleared rule.
+#include "../src/main.cpp"
+#include "host.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* message) {
+  if (!condition) {
+    printf("FAIL: %s\n", message);
+    failures++;
+  }
+}
+
+static String dueRule() {
+  DateTime now = rtc.now();
+  return "b4|100|" + String((now.hour() * 60 + now.minute() + 2) % 1440) + "_";
+}
+
+int main() {
+  host_files["/settings.txt"] = "{\"ver\":\"30.25\",\"gen\":1,\"ssid\":\"host\",\"password\":\"password\",\"steps\":[3000,3000,3000]}";
+  setup();
+  host_run(10000, 1000);
+  check(RTCisrunning(), "clock set");
+
+  check(host_request(HTTP_PUT, "/set", "{\"smart\":\"b4|100|<," + dueRule() + "\"}").code == 200, "rules set");
+  host_run(5000, 1000);
+  check(smart_subscribers_first[smart_inputs] > 0, "dusk rule subscribed to the light");
+  check(host_request(HTTP_PUT, "/set", "{\"smart\":\"\"}").code == 200, "rules cleared");
+  host_run(5000, 1000);
+  check(smart_subscribers_first[smart_inputs] == 0 && smart_timeline_count == 0, "timeline and subscribers emptied");
+  check(host_request(HTTP_PUT, "/set", "{\"light\":\"5t\"}").code == 200, "dusk received");
+  host_run(200000, 1000);
+  check(smart_count == 0, "no rules");
+  check(destination[0] == 0 && destination[1] == 0 && destination[2] == 0 && actual[0] == 0, "cleared rule didn't fire");
+
+  HostReply reply = host_request(HTTP_POST, "/smart", dueRule());
+  check(reply.code == 200, "rule added");
+  host_run(5000, 1000);
+  check(host_request(HTTP_DELETE, "/smart?id=" + reply.content, "").code == 200, "rule removed");
+  host_run(200000, 1000);
+  check(destination[0] == 0 && actual[0] == 0, "removed rule didn't fire");
+
+  check(host_request(HTTP_PUT, "/set", "{\"smart\":\"" + dueRule() + "\"}").code == 200, "rule set again");
+  host_run(200000, 1000);
+  check(destination[0] == 3000, "a live rule still fires");
+
+  printf(failures == 0 ? "OK\n" : "%d checks failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
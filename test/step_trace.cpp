@@ -0,0 +1,105 @@
+// Steps three wings in both directions on the virtual clock and checks the pin trace the drivers see.
+// The wings share the STEP and DIR lines and the drivers count every pulse even when disabled, so no
+// pulse may go against a wing while it moves, and the trace must not depend on the run.
+#include "../src/main.cpp"
+#include "host.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* message) {
+  if (!condition) {
+    printf("FAIL: %s\n", message);
+    failures++;
+  }
+}
+
+static std::vector<HostPinEvent> runMove(const int from[3], const int to[3]) {
+  for (int i = 0; i < 3; i++) {
+    actual[i] = from[i];
+    destination[i] = to[i];
+  }
+  host_pin_trace.clear();
+  host_trace = true;
+  startStepper();
+  host_advance(2000000);
+  stopStepper();
+  host_trace = false;
+
+  std::vector<HostPinEvent> trace = host_pin_trace;
+  uint64_t start_us = trace.empty() ? 0 : trace.front().us;
+  for (HostPinEvent& event : trace) {
+    event.us -= start_us;
+  }
+  return trace;
+}
+
+static void checkMove(const char* name, const int from[3], const int to[3], int pulses) {
+  std::vector<HostPinEvent> trace = runMove(from, to);
+  int position[3] = {from[0], from[1], from[2]};
+  int first[3] = {-1, -1, -1};
+  int last[3] = {-1, -1, -1};
+  std::vector<int> directions;
+  int direction = 0;
+  bool enabled[3] = {false, false, false};
+
+  for (const HostPinEvent& event : trace) {
+    if (event.pin == bipolar_direction_pin) {
+      direction = event.value == (reversed ? HIGH : LOW) ? -1 : 1;
+    }
+    for (int i = 0; i < 3; i++) {
+      if (event.pin == bipolar_enable_pin[i]) {
+        enabled[i] = event.value == LOW;
+      }
+    }
+    if (event.pin == bipolar_step_pin && event.value == HIGH) {
+      for (int i = 0; i < 3; i++) {
+        if (enabled[i]) {
+          position[i] += direction;
+          first[i] = first[i] < 0 ? directions.size() : first[i];
+          last[i] = directions.size();
+        }
+      }
+      directions.push_back(direction);
+    }
+  }
+
+  printf("%s: %d pulses\n", name, (int)directions.size());
+  check((int)directions.size() == pulses, "pulse count");
+  for (int i = 0; i < 3; i++) {
+    check(position[i] == actual[i], "actual[] follows the pulses the enabled driver took");
+    check(actual[i] == to[i], "wing reached its destination");
+    for (int p = first[i]; p >= 0 && p <= last[i]; p++) { // Disabled or not, the driver counts these.
+      check(directions[p] == (to[i] < from[i] ? -1 : 1), "no pulse against a moving wing");
+    }
+  }
+
+  std::vector<HostPinEvent> again = runMove(from, to);
+  bool same = again.size() == trace.size();
+  for (size_t i = 0; same && i < trace.size(); i++) {
+    same = again[i].us == trace[i].us && again[i].pin == trace[i].pin && again[i].value == trace[i].value;
+  }
+  check(same, "trace repeats exactly");
+}
+
+int main() {
+  host_files["/settings.txt"] = "{\"ver\":\"30.25\",\"gen\":1,\"steps\":[3000,3000,3000]}";
+  setup();
+
+  const int start[] = {100, 100, 100};
+  const int same_way[] = {130, 100, 110};
+  const int both_ways[] = {130, 80, 110};
+  checkMove("same direction", start, same_way, 30); // Wings 1 and 3 share the first 10 pulses.
+  checkMove("both directions", start, both_ways, 50); // Down waits for up: 30 pulses, then 20.
+  inverted_sequence = true;
+  checkMove("both directions, inverted", start, both_ways, 50);
+  inverted_sequence = false;
+  separately = true;
+  checkMove("separately", start, both_ways, 60);
+  separately = false;
+  acceleration = 10;
+  cruise = 1000;
+  checkMove("both directions, ramp", start, both_ways, 50);
+
+  printf(failures == 0 ? "OK\n" : "%d checks failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}